@@ -0,0 +1,74 @@
+/*
+   Copyright (C) 2010 Jonathan Beck <jonabeck@gmail.com>
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public
+   License (LGPL) as published by the Free Software Foundation;
+   either version 2 of the License, or (at your option) any later
+   version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public License
+   along with this library; see the file COPYING.LIB.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+*/
+
+#include "afcclientpool.h"
+
+#include <libimobiledevice/lockdown.h>
+
+#include <QtCore/QMutexLocker>
+
+#define AFC_PROTO "com.apple.afc"
+
+AfcClientPool::AfcClientPool( idevice_t dev ) : _dev(dev)
+{
+}
+
+AfcClientPool::~AfcClientPool()
+{
+    foreach ( afc_client_t client, _idle )
+        afc_client_free (client);
+}
+
+afc_client_t AfcClientPool::acquire()
+{
+    {
+        QMutexLocker lock(&_mutex);
+        if ( !_idle.isEmpty() )
+            return _idle.takeLast();
+    }
+    return connect(_dev);
+}
+
+void AfcClientPool::release( afc_client_t client )
+{
+    if ( NULL == client )
+        return;
+
+    QMutexLocker lock(&_mutex);
+    _idle.append(client);
+}
+
+afc_client_t AfcClientPool::connect( idevice_t dev )
+{
+    afc_client_t client = NULL;
+
+    lockdownd_client_t lockdown_cli = NULL;
+    if ( LOCKDOWN_E_SUCCESS == lockdownd_client_new_with_handshake (dev, &lockdown_cli, "kio_afc") )
+    {
+        uint16_t port;
+        if ( LOCKDOWN_E_SUCCESS == lockdownd_start_service (lockdown_cli, AFC_PROTO, &port) )
+        {
+            afc_client_new (dev, port, &client);
+        }
+    }
+    lockdownd_client_free (lockdown_cli);
+
+    return client;
+}
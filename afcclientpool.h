@@ -0,0 +1,45 @@
+/***************************************************************************
+ *   Copyright (C) 2010 by Jonathan Beck <jonabeck@gmail.com>              *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ ***************************************************************************/
+
+#ifndef AFCCLIENTPOOL_H
+#define AFCCLIENTPOOL_H
+
+#include <libimobiledevice/libimobiledevice.h>
+#include <libimobiledevice/afc.h>
+
+#include <QtCore/QMutex>
+#include <QtCore/QList>
+
+/**
+ * Extra AFC connections to one device, for work that runs on several
+ * threads at once. Connections are opened on demand and kept for reuse
+ * until the pool is destroyed.
+ */
+class AfcClientPool
+{
+public:
+    AfcClientPool( idevice_t dev );
+    ~AfcClientPool();
+
+    /**
+     * @return an idle connection, or a new one; NULL if the device refused it
+     */
+    afc_client_t acquire();
+    void release( afc_client_t client );
+
+    static afc_client_t connect( idevice_t dev );
+
+private:
+    idevice_t _dev;
+
+    QMutex _mutex;
+    QList<afc_client_t> _idle;
+};
+
+#endif // AFCCLIENTPOOL_H
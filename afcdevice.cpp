@@ -20,25 +20,94 @@
 
 #include "afcdevice.h"
 #include "kio_afc.h"
+#include "afctransfer.h"
+#include "afcreadcache.h"
+#include "afcclientpool.h"
+#include "afcdirlister.h"
+#include "afcdeviceinfo.h"
+#include "afcparallel.h"
+#include "afctreewalker.h"
+#include "afcindex.h"
+#include "afcindexupdater.h"
+#include "afcsearch.h"
+#include "afcsync.h"
 
 #include <kdebug.h>
+#include <klocale.h>
+#include <kurl.h>
 
-#include <QtCore/QVarLengthArray>
+#include <QtCore/QCryptographicHash>
 #include <QtCore/QDateTime>
+#include <QtCore/QFile>
+#include <QtCore/QHash>
+#include <QtCore/QMutexLocker>
+#include <QtCore/QSet>
+
+#include <kde_file.h>
+
+#include <config-kio_afc.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <utime.h>
 
 
 #define AFC_PROTO "com.apple.afc"
 #define KIO_AFC 7002
 
+#define AFC_MIN_CHUNK_SIZE (256 * 1024)
+#define AFC_DEFAULT_CHUNK_SIZE (1024 * 1024)
+#define AFC_MAX_CHUNK_SIZE (4 * 1024 * 1024)
+
+#define AFC_MAX_STAT_WORKERS 4
+#define AFC_ENTRIES_PER_STAT_WORKER 32
+
+#define AFC_RESUME_TAIL_SIZE (64 * 1024)
+
+//seconds the free space of the device is trusted
+#define AFC_FREE_SPACE_TTL 2
+
+//seconds an unplugged device has to come back before transfers fail
+#define AFC_RECONNECT_GRACE 30
+
+#define AFC_BYTES_PER_CONNECTION (64 * 1024 * 1024)
+#define AFC_DEFAULT_TRANSFER_CONNECTIONS 4
+#define AFC_MAX_TRANSFER_CONNECTIONS 8
+
 using namespace KIO;
 
-AfcDevice::AfcDevice( const char* id, AfcProtocol* proto ) :_proto(proto), openFd(-1)
+AfcDevice::AfcDevice( const char* id, AfcProtocol* proto ) :_proto(proto), _present(true), _lost(false), _removedAt(0),
+        openFd(-1), _readCache(NULL), _pool(NULL), _index(NULL), _indexUpdater(NULL),
+        _freeSpaceTotal(0), _freeSpaceAvailable(0), _freeSpaceStamp(0)
 {
+    //only a descriptor, the device is contacted on first use
     _id = id;
     _dev = NULL;
     _afc = NULL;
+}
+
+bool AfcDevice::connect( KIO::Error& error )
+{
+    {
+        QMutexLocker lock(&_stateMutex);
+        if ( isValid() && !_lost )
+            return true;
+    }
+
+    //the device was unplugged since, nothing can be done on the old
+    //connection anymore
+    if ( isValid() )
+        disconnect();
+
+    kDebug(KIO_AFC) << "connecting to" << _id;
 
-    idevice_new (&_dev, id);
+    if ( NULL == _dev && IDEVICE_E_SUCCESS != idevice_new (&_dev, _id.toLocal8Bit()) )
+    {
+        _dev = NULL;
+        error = KIO::ERR_COULD_NOT_CONNECT;
+        return false;
+    }
 
     lockdownd_client_t lockdown_cli = NULL;
     if ( LOCKDOWN_E_SUCCESS == lockdownd_client_new_with_handshake (_dev, &lockdown_cli, "kio_afc") )
@@ -81,16 +150,130 @@ AfcDevice::AfcDevice( const char* id, AfcProtocol* proto ) :_proto(proto), openF
         }
     }
     lockdownd_client_free (lockdown_cli);
+
+    if ( !isValid() )
+    {
+        error = KIO::ERR_COULD_NOT_CONNECT;
+        return false;
+    }
+
+    if ( NULL == _pool )
+        _pool = new AfcClientPool(_dev);
+
+    AfcDeviceInfo::store(_id, _name, _icon);
+    return true;
 }
 
 AfcDevice::~AfcDevice()
 {
+    delete _readCache;
+    delete _indexUpdater;
+    delete _index;
+    delete _pool;
     idevice_free(_dev);
     afc_client_free(_afc);
     _dev = NULL;
     _afc = NULL;
 }
 
+void AfcDevice::setPresent( bool present )
+{
+    QMutexLocker lock(&_stateMutex);
+
+    _present = present;
+    if ( !present )
+    {
+        _lost = true;
+        _removedAt = time(NULL);
+    }
+}
+
+bool AfcDevice::isPresent() const
+{
+    QMutexLocker lock(&_stateMutex);
+    return _present;
+}
+
+bool AfcDevice::isGone() const
+{
+    QMutexLocker lock(&_stateMutex);
+    return !_present && time(NULL) - _removedAt > AFC_RECONNECT_GRACE;
+}
+
+void AfcDevice::disconnect()
+{
+    kDebug(KIO_AFC) << "dropping the connection to" << _id;
+
+    //the updater and the pool work on connections of the old device
+    delete _indexUpdater;
+    _indexUpdater = NULL;
+    delete _pool;
+    _pool = NULL;
+
+    delete _readCache;
+    _readCache = NULL;
+    openFd = -1;
+    openPath = "";
+    _writeBuffer.clear();
+    _metaCache.clear();
+
+    afc_client_free(_afc);
+    idevice_free(_dev);
+    _afc = NULL;
+    _dev = NULL;
+
+    QMutexLocker lock(&_stateMutex);
+    _lost = false;
+}
+
+bool AfcDevice::isConnectionLost( afc_error_t err )
+{
+    return AFC_E_SERVICE_NOT_CONNECTED == err || AFC_E_IO_ERROR == err || AFC_E_MUX_ERROR == err;
+}
+
+bool AfcDevice::reconnect( afc_error_t err )
+{
+    if ( !isConnectionLost(err) )
+        return false;
+
+    kDebug(KIO_AFC) << "connection to" << _id << "lost:" << err;
+    disconnect();
+
+    //wait for the device to come back, a hub reset takes a few seconds
+    const time_t deadline = time(NULL) + AFC_RECONNECT_GRACE;
+    _proto->infoMessage( i18n("Waiting for the device to come back...") );
+    while ( time(NULL) < deadline && !_proto->wasKilled() )
+    {
+        KIO::Error error;
+        if ( isPresent() && connect(error) )
+        {
+            _proto->infoMessage( QString() );
+            return true;
+        }
+        ::sleep(1);
+    }
+    return false;
+}
+
+QString AfcDevice::name()
+{
+    //another slave may already know the device, no need for a handshake
+    if ( _name.isEmpty() )
+        AfcDeviceInfo::load(_id, _name, _icon);
+    return _name;
+}
+
+QByteArray AfcDevice::nativePath( const QString& path )
+{
+    //commands usually work on the same path several times in a row
+    if ( path != _nativeFor )
+    {
+        _nativeFor = path;
+        _native = path.toLocal8Bit();
+    }
+    return _native;
+}
+
 bool AfcDevice::isValid()
 {
     if ( NULL != _dev && NULL != _afc )
@@ -101,6 +284,12 @@ bool AfcDevice::isValid()
 
 bool AfcDevice::createRootUDSEntry( UDSEntry & entry )
 {
+    //only a device that accepts a session is listed, a locked or untrusted
+    //one must not look browsable
+    KIO::Error error;
+    if ( !connect(error) )
+        return false;
+
     entry.insert( UDSEntry::UDS_NAME, _id );
     entry.insert( UDSEntry::UDS_DISPLAY_NAME, _name );
     entry.insert( UDSEntry::UDS_ICON_NAME, _icon );
@@ -113,73 +302,170 @@ bool AfcDevice::createRootUDSEntry( UDSEntry & entry )
 
 bool AfcDevice::createUDSEntry( const QString & filename, const QString & path, UDSEntry & entry, KIO::Error& error )
 {
-    bool rc = false;
+    afc_error_t ret;
+    if ( !_metaCache.lookup(path, entry, ret) )
+    {
+        ret = fillUDSEntry(_afc, filename, path, entry);
+        _metaCache.insert(path, entry, ret);
+        if ( NULL != _index && AFC_E_SUCCESS == ret )
+            _index->updateItem(path, entry);
+    }
+    entry.insert(UDSEntry::UDS_NAME, filename);
+    return checkError(ret, error);
+}
+
+//keys of afc_get_file_info() that are used
+enum AfcInfoKey
+{
+    AFC_INFO_UNKNOWN,
+    AFC_INFO_SIZE,
+    AFC_INFO_NLINK,
+    AFC_INFO_IFMT,
+    AFC_INFO_MTIME,
+    AFC_INFO_BIRTHTIME,
+    AFC_INFO_LINK_TARGET
+};
+
+struct AfcFileType
+{
+    const char* name;
+    mode_t type;
+    mode_t access;
+};
+
+static const AfcFileType fileTypes[] =
+{
+    { "S_IFREG", S_IFREG, 0644 },
+    { "S_IFDIR", S_IFDIR, 0755 },
+    { "S_IFLNK", S_IFLNK, 0777 },
+    { "S_IFBLK", S_IFBLK, 0644 },
+    { "S_IFCHR", S_IFCHR, 0644 },
+    { "S_IFIFO", S_IFIFO, 0644 },
+    { "S_IFSOCK", S_IFSOCK, 0644 }
+};
+
+//one character tells the candidate apart, a single compare confirms it
+static AfcInfoKey infoKey( const char* key )
+{
+    const char* name;
+    AfcInfoKey found;
+
+    if ( 'L' == key[0] )
+    {
+        name = "LinkTarget";
+        found = AFC_INFO_LINK_TARGET;
+    }
+    else if ( 's' == key[0] && 't' == key[1] && '_' == key[2] )
+    {
+        switch ( key[3] )
+        {
+        case 's':
+            name = "st_size";
+            found = AFC_INFO_SIZE;
+            break;
+        case 'n':
+            name = "st_nlink";
+            found = AFC_INFO_NLINK;
+            break;
+        case 'i':
+            name = "st_ifmt";
+            found = AFC_INFO_IFMT;
+            break;
+        case 'm':
+            name = "st_mtime";
+            found = AFC_INFO_MTIME;
+            break;
+        case 'b':
+            name = "st_birthtime";
+            found = AFC_INFO_BIRTHTIME;
+            break;
+        default:
+            return AFC_INFO_UNKNOWN;
+        }
+    }
+    else
+    {
+        return AFC_INFO_UNKNOWN;
+    }
+
+    return strcmp(key, name) ? AFC_INFO_UNKNOWN : found;
+}
+
+static const AfcFileType* fileType( const char* value )
+{
+    if ( strncmp(value, "S_IF", 4) )
+        return NULL;
+
+    const AfcFileType* type;
+    switch ( value[4] )
+    {
+    case 'R': type = &fileTypes[0]; break;
+    case 'D': type = &fileTypes[1]; break;
+    case 'L': type = &fileTypes[2]; break;
+    case 'B': type = &fileTypes[3]; break;
+    case 'C': type = &fileTypes[4]; break;
+    case 'I': type = &fileTypes[5]; break;
+    case 'S': type = &fileTypes[6]; break;
+    default:
+        return NULL;
+    }
+    return strcmp(value, type->name) ? NULL : type;
+}
+
+afc_error_t AfcDevice::fillUDSEntry( afc_client_t afc, const QString & filename, const QString & path, UDSEntry & entry )
+{
     char **info = NULL;
 
-    afc_error_t ret = afc_get_file_info(_afc, (const char*) path.toLocal8Bit(), &info);
+    afc_error_t ret = afc_get_file_info(afc, (const char*) path.toLocal8Bit(), &info);
 
-    if ( checkError(ret, error) && NULL != info )
+    if ( AFC_E_SUCCESS == ret && NULL == info )
+        ret = AFC_E_UNKNOWN_ERROR;
+
+    if ( AFC_E_SUCCESS == ret )
     {
-        rc = true;
         entry.insert(UDSEntry::UDS_NAME, filename);
-        // get file attributes from info list
+        // get file attributes from info list, st_blocks has no UDS field
         for (int i = 0; info[i]; i += 2)
         {
-            if (!strcmp(info[i], "st_size"))
+            const char* value = info[i+1];
+            if ( NULL == value )
             {
-                entry.insert( UDSEntry::UDS_SIZE, atoll(info[i+1]) );
+                free (info[i]);
+                break;
             }
-            else if (!strcmp(info[i], "st_blocks"))
+
+            switch ( infoKey(info[i]) )
             {
-                // stbuf->st_blocks = atoi(info[i+1]);
-            }
-            else if (!strcmp(info[i], "st_ifmt"))
+            case AFC_INFO_SIZE:
+                entry.insert( UDSEntry::UDS_SIZE, strtoll(value, NULL, 10) );
+                break;
+            case AFC_INFO_NLINK:
+                entry.insert( UDSEntry::UDS_NUMBER, strtol(value, NULL, 10) );
+                break;
+            case AFC_INFO_IFMT:
             {
-                if (!strcmp(info[i+1], "S_IFREG"))
-                {
-                    entry.insert( UDSEntry::UDS_FILE_TYPE, S_IFREG );
-                    entry.insert( UDSEntry::UDS_ACCESS, 0644 );
-                }
-                else if (!strcmp(info[i+1], "S_IFDIR"))
-                {
-                    entry.insert( UDSEntry::UDS_FILE_TYPE, S_IFDIR );
-                    entry.insert( UDSEntry::UDS_ACCESS, 0755 );
-                }
-                else if (!strcmp(info[i+1], "S_IFLNK"))
-                {
-                    entry.insert( UDSEntry::UDS_FILE_TYPE, S_IFLNK );
-                    entry.insert( UDSEntry::UDS_ACCESS, 0777 );
-                }
-                else if (!strcmp(info[i+1], "S_IFBLK"))
-                {
-                    entry.insert( UDSEntry::UDS_FILE_TYPE, S_IFBLK );
-                    entry.insert( UDSEntry::UDS_ACCESS, 0644 );
-                }
-                else if (!strcmp(info[i+1], "S_IFCHR"))
-                {
-                    entry.insert( UDSEntry::UDS_FILE_TYPE, S_IFCHR );
-                    entry.insert( UDSEntry::UDS_ACCESS, 0644 );
-                }
-                else if (!strcmp(info[i+1], "S_IFIFO"))
-                {
-                    entry.insert( UDSEntry::UDS_FILE_TYPE, S_IFIFO );
-                    entry.insert( UDSEntry::UDS_ACCESS, 0644 );
-                }
-                else if (!strcmp(info[i+1], "S_IFSOCK"))
+                const AfcFileType* type = fileType(value);
+                if ( NULL != type )
                 {
-                    entry.insert( UDSEntry::UDS_FILE_TYPE, S_IFSOCK );
-                    entry.insert( UDSEntry::UDS_ACCESS, 0644 );
+                    entry.insert( UDSEntry::UDS_FILE_TYPE, type->type );
+                    entry.insert( UDSEntry::UDS_ACCESS, type->access );
                 }
+                break;
             }
-            else if (!strcmp(info[i], "st_nlink"))
-            {
-                entry.insert( UDSEntry::UDS_NUMBER, atoi(info[i+1]));
-            }
-            else if (!strcmp(info[i], "st_mtime"))
-            {
-                entry.insert( UDSEntry::UDS_MODIFICATION_TIME, atoll(info[i+1]) / 1000000000 );
+            case AFC_INFO_MTIME:
+                entry.insert( UDSEntry::UDS_MODIFICATION_TIME, strtoll(value, NULL, 10) / 1000000000 );
+                break;
+            case AFC_INFO_BIRTHTIME:
+                entry.insert( UDSEntry::UDS_CREATION_TIME, strtoll(value, NULL, 10) / 1000000000 );
+                break;
+            case AFC_INFO_LINK_TARGET:
+                entry.insert( UDSEntry::UDS_LINK_DEST, QString::fromLocal8Bit(value) );
+                break;
+            case AFC_INFO_UNKNOWN:
+                break;
             }
             free (info[i]);
+            free (info[i+1]);
         }
         free(info);
     }
@@ -187,7 +473,7 @@ bool AfcDevice::createUDSEntry( const QString & filename, const QString & path,
     entry.insert( UDSEntry::UDS_USER, AfcProtocol::m_user );
     entry.insert( UDSEntry::UDS_GROUP, AfcProtocol::m_group );
 
-    return rc;
+    return ret;
 }
 
 bool AfcDevice::checkError( afc_error_t error, KIO::Error& err_id )
@@ -270,50 +556,205 @@ bool AfcDevice::get(const QString& path, KIO::Error& error)
 {
     kDebug(KIO_AFC) << path;
 
-    bool ret = false;
+    if ( !connect(error) )
+        return false;
+
     UDSEntry entry;
-    if ( createUDSEntry( "", path, entry, error ) )
+    if ( !createUDSEntry( "", path, entry, error ) )
+        return false;
+
+    KIO::filesize_t size = entry.numberValue(UDSEntry::UDS_SIZE);
+    KIO::filesize_t position = resumeOffset(path, size);
+
+    if ( position > 0 )
+        _proto->canResume();
+    _proto->totalSize( size );
+
+    //a connection lost on the way is opened again, and the transfer goes
+    //on from what was already sent
+    afc_error_t err;
+    int ignored = 0;
+    while ( AFC_E_SUCCESS != ( err = sendFile(path, size, position, -1, ignored) ) && reconnect(err) )
+        kDebug(KIO_AFC) << "going on with" << path << "at" << position;
+
+    if ( !checkError(err, error) )
+        return false;
+
+    // empty array designates eof
+    _proto->data(QByteArray());
+    return true;
+}
+
+static bool writeLocalFile( int fd, const QByteArray& data )
+{
+    const char* ptr = data.constData();
+    ssize_t left = data.size();
+
+    while ( left > 0 )
+    {
+        const ssize_t n = ::write( fd, ptr, left );
+        if ( n < 0 && errno == EINTR )
+            continue;
+        if ( n < 0 )
+            return false;
+        ptr += n;
+        left -= n;
+    }
+    return true;
+}
+
+//hands a chunk to the job, or to a local file when fd is valid
+static bool deliver( AfcProtocol* proto, int fd, const QByteArray& data, int& writeError )
+{
+    if ( fd < 0 )
+    {
+        proto->data( data );
+        return true;
+    }
+    if ( writeLocalFile( fd, data ) )
+        return true;
+
+    //errno is taken before anything else can overwrite it
+    writeError = errno;
+    return false;
+}
+
+afc_error_t AfcDevice::sendFile( const QString& path, KIO::filesize_t size, KIO::filesize_t& position, int fd, int& writeError )
+{
+    QByteArray array;
+
+    //big files are split over several connections
+    const int connections = transferConnections(size - position);
+    if ( connections > 1 )
     {
-        if ( open(path, QIODevice::ReadOnly, error) )
+        AfcParallelReader reader(_pool, path, size, chunkSize(), connections, position);
+        if ( reader.start() )
         {
-            KIO::filesize_t size = entry.numberValue(UDSEntry::UDS_SIZE);
-            ret = read(size, error);
+            while ( reader.next(array) && deliver( _proto, fd, array, writeError ) )
+            {
+                position += array.size();
+                if ( fd >= 0 )
+                    _proto->processedSize( position );
+            }
+            return reader.error();
+        }
+    }
 
-            close();
+    //the size is already known, do not stat again in open()
+    uint64_t afcFd = 0;
+    afc_error_t err = afc_file_open(_afc, (const char*) nativePath(path), AFC_FOPEN_RDONLY, &afcFd);
+    if ( AFC_E_SUCCESS != err )
+        return err;
+
+    if ( position > 0 )
+        err = afc_file_seek(_afc, afcFd, position, SEEK_SET);
+
+    if ( AFC_E_SUCCESS == err )
+    {
+        //the reader thread keeps the device busy while we push data to the job
+        AfcReader reader(_afc, afcFd, size - position, chunkSize());
+        reader.start();
+
+        while ( reader.next(array) && deliver( _proto, fd, array, writeError ) )
+        {
+            position += array.size();
+            if ( fd >= 0 )
+                _proto->processedSize( position );
+            reader.release();
         }
+        reader.abort();
+        reader.wait();
+        err = reader.error();
     }
-    return ret;
+
+    afc_file_close(_afc, afcFd);
+    return err;
+}
+
+KIO::filesize_t AfcDevice::resumeOffset( const QString& path, KIO::filesize_t size )
+{
+    //set by KIO when a partial copy of the file is already there
+    bool ok = false;
+    const KIO::filesize_t offset = _proto->metaData( QLatin1String("resume") ).toULongLong( &ok );
+    if ( !ok || 0 == offset )
+        return 0;
+
+    //a partial copy as big as the file is from another version of it
+    if ( offset >= size )
+        return 0;
+
+    //applications can check that their partial copy still matches by
+    //sending the MD5 of its last bytes in hex
+    const QString tail = _proto->metaData( QLatin1String("resume-tail-md5") );
+    if ( !tail.isEmpty() )
+    {
+        const uint32_t length = (uint32_t) qMin( offset, (KIO::filesize_t) AFC_RESUME_TAIL_SIZE );
+
+        uint64_t fd = 0;
+        if ( AFC_E_SUCCESS != afc_file_open( _afc, (const char*) nativePath(path), AFC_FOPEN_RDONLY, &fd ) )
+            return 0;
+
+        QByteArray data( length, Qt::Uninitialized );
+        uint32_t total = 0;
+        afc_error_t err = afc_file_seek( _afc, fd, offset - length, SEEK_SET );
+        while ( AFC_E_SUCCESS == err && total < length )
+        {
+            uint32_t bytes_read = 0;
+            err = afc_file_read( _afc, fd, data.data() + total, length - total, &bytes_read );
+            if ( 0 == bytes_read )
+                break;
+            total += bytes_read;
+        }
+        afc_file_close( _afc, fd );
+
+        if ( total != length ||
+             QCryptographicHash::hash( data, QCryptographicHash::Md5 ).toHex() != tail.toLatin1().toLower() )
+        {
+            kDebug(KIO_AFC) << "partial copy of" << path << "does not match, starting over";
+            return 0;
+        }
+    }
+    return offset;
 }
 
 bool AfcDevice::put( const QString& path, KIO::JobFlags _flags, KIO::Error& error )
 {
     kDebug(KIO_AFC) << path << _flags;
 
-    UDSEntry entry;
-    const bool bOrigExists = createUDSEntry( "", path, entry, error);
+    if ( !connect(error) )
+        return false;
 
-    if ( bOrigExists && !(_flags & KIO::Overwrite) && !(_flags & KIO::Resume))
+    //only check the destination when we are not allowed to replace it,
+    //opening with truncation takes care of the other cases
+    if ( !(_flags & KIO::Overwrite) && !(_flags & KIO::Resume) )
     {
-        if ( S_ISDIR ( entry.numberValue(UDSEntry::UDS_FILE_TYPE ) ) )
-            error = KIO::ERR_DIR_ALREADY_EXIST;
-        else
-            error = KIO::ERR_FILE_ALREADY_EXIST;
+        UDSEntry entry;
+        if ( createUDSEntry( "", path, entry, error) )
+        {
+            if ( S_ISDIR ( entry.numberValue(UDSEntry::UDS_FILE_TYPE ) ) )
+                error = KIO::ERR_DIR_ALREADY_EXIST;
+            else
+                error = KIO::ERR_FILE_ALREADY_EXIST;
+            return false;
+        }
+        if ( KIO::ERR_DOES_NOT_EXIST != error )
+            return false;
+    }
+
+    //a known size that does not fit is refused before anything is sent
+    const KIO::filesize_t expected = (_flags & KIO::Resume) ? 0 : _proto->metaData("size").toULongLong();
+    if ( expected > 0 && !hasRoomFor( path, expected, _flags & KIO::Overwrite ) )
+    {
+        error = KIO::ERR_DISK_FULL;
         return false;
     }
 
     //open file
     if ( !path.isEmpty() )
     {
-        if ( bOrigExists && !(_flags & KIO::Resume) )
-        {
-            kDebug(KIO_AFC) << "Deleting destination file" << path;
-            if ( ! del (path, error) )
-                return false;
-        }
-
         if ( (_flags & KIO::Resume) )
         {
-            if ( ! open(path, QIODevice::Append, error) )
+            if ( ! openFile(path, QIODevice::Append, error) )
                 return false;
 
             if ( ! checkError (afc_file_seek(_afc, openFd, 0, SEEK_END), error ) )
@@ -324,37 +765,127 @@ bool AfcDevice::put( const QString& path, KIO::JobFlags _flags, KIO::Error& erro
         }
         else
         {
-            if ( ! open(path, QIODevice::ReadWrite | QIODevice::Truncate, error) )
+            if ( ! openFile(path, QIODevice::ReadWrite | QIODevice::Truncate, error) )
                 return false;
+            if ( ! preallocate(path, expected, error) )
+                return false;
+        }
+    }
+
+    int result = 1;
+    KIO::filesize_t received = 0;
+
+    //bytes known to be on the device before the data held by the writer
+    KIO::filesize_t base = 0;
+    if ( (_flags & KIO::Resume) )
+    {
+        uint64_t position = 0;
+        if ( ! checkError( afc_file_tell(_afc, openFd, &position), error ) )
+        {
+            close();
+            return false;
+        }
+        base = position;
+    }
+
+    //big uploads of a known size are split over several connections
+    const int connections = (_flags & KIO::Resume) ? 1 : transferConnections( _proto->metaData("size").toULongLong() );
+    AfcParallelWriter* parallel = NULL;
+    if ( connections > 1 )
+    {
+        parallel = new AfcParallelWriter(_pool, path, chunkSize(), connections);
+        if ( !parallel->start() )
+        {
+            delete parallel;
+            parallel = NULL;
         }
     }
 
-    int result;
+    AfcWriter* writer = NULL;
+    afc_error_t err = AFC_E_SUCCESS;
+    bool finished = false;
+    bool failed = false;
+
+    if ( NULL != parallel )
+    {
+        QByteArray buffer;
+        do
+        {
+            _proto->dataReq(); // Request for data
+            result = _proto->readData( buffer );
+            if ( result > 0 )
+                received += result;
+        }
+        while ( result > 0 && parallel->push( buffer ) );
+
+        //a lost connection ends the parallel part, the rest goes over a
+        //single connection
+        if ( result < 0 )
+        {
+            QList<QByteArray> dropped;
+            base = parallel->takePending(dropped);
+        }
+        else if ( result == 0 && parallel->finish() )
+        {
+            finished = true;
+        }
+        else
+        {
+            failed = !recoverParallel( path, parallel, err, base, writer );
+        }
+        delete parallel;
+    }
+    else
+    {
+        //the writer thread drains the queue to the device while we keep
+        //requesting data from the job, the bounded queue provides back-pressure
+        writer = new AfcWriter(_afc, openFd);
+        writer->start();
+    }
 
     // Loop until we got 0 (end of data)
-    do
+    while ( result > 0 && !failed )
     {
         QByteArray buffer;
         _proto->dataReq(); // Request for data
         result = _proto->readData( buffer );
+        if ( result > 0 )
+            received += result;
 
-        if (result >= 0)
-        {
-            if ( ! write( buffer, error) )
-            {
-                result = -1;
-            }
-        }
+        //the data refused by a failed writer is kept with its pending chunks
+        if ( result > 0 && !writer->push( buffer ) )
+            failed = !recoverWriter( path, writer, base, err );
+    }
+
+    //a writer that could not be recovered is already gone
+    if ( NULL != writer )
+    {
+        if ( result < 0 )
+            writer->abort();
+        while ( !( finished = writer->finish() ) && result == 0 && recoverWriter( path, writer, base, err ) )
+            ;
+    }
+    if ( NULL != writer )
+    {
+        if ( !finished )
+            err = writer->error();
+        base += writer->written();
+        delete writer;
     }
-    while ( result > 0 );
 
     // An error occurred deal with it.
-    if (result < 0)
+    if ( !finished )
     {
-        kDebug(KIO_AFC) << "Error during 'put'. Aborting.";
+        kDebug(KIO_AFC) << "Error during 'put'. Aborting at" << base;
+        if ( AFC_E_SUCCESS == err || checkError( err, error ) )
+            error = KIO::ERR_ABORTED;
+        invalidate(path);
 
         if (openFd != (uint64_t)-1)
         {
+            //the file was preallocated, keep only what surely reached the
+            //device so that the job can be resumed
+            afc_file_truncate(_afc, openFd, base);
             close();
         }
         return false;
@@ -365,19 +896,15 @@ bool AfcDevice::put( const QString& path, KIO::JobFlags _flags, KIO::Error& erro
         return true;
     }
 
+    //the upload was shorter than announced
+    if ( received < expected )
+        afc_file_truncate(_afc, openFd, received);
+
     close();
+    invalidate(path);
 
     // set modification time
-    const QString mtimeStr = _proto->metaData(QLatin1String("modified"));
-    if ( !mtimeStr.isEmpty() )
-    {
-        QDateTime dt = QDateTime::fromString( mtimeStr, Qt::ISODate );
-        if ( dt.isValid() )
-        {
-            setModificationTime(path, dt, error);
-            //do not trigger error just for time
-        }
-    }
+    setModificationTimeFromMetaData(path);
 
     // We have done our job => finish
     return true;
@@ -385,6 +912,9 @@ bool AfcDevice::put( const QString& path, KIO::JobFlags _flags, KIO::Error& erro
 
 bool AfcDevice::stat( const QString& filename, const QString& path, KIO::Error& error )
 {
+    if ( !connect(error) )
+        return false;
+
     bool ret = false;
     UDSEntry entry;
 
@@ -398,31 +928,90 @@ bool AfcDevice::stat( const QString& filename, const QString& path, KIO::Error&
 
 bool AfcDevice::listDir(const QString& path, KIO::Error& error)
 {
-    bool ret = false;
+    if ( !connect(error) )
+        return false;
+
+    bool ret = false;
 
     char **list = NULL;
-    afc_error_t err = afc_read_directory (_afc, (const char*) path.toLocal8Bit(), &list);
+    afc_error_t err = afc_read_directory (_afc, (const char*) nativePath(path), &list);
     if ( checkError(err, error) )
     {
         ret = true;
+        QStringList names;
         char** ptr = list;
         while ( NULL != *ptr )
         {
             if ( 0 != QString::compare(*ptr, ".") && 0 != QString::compare(*ptr, "..") )
             {
-                QString subPath = path.compare("/") ? path : "";
-                subPath += "/";
-                subPath += *ptr;
-
-                UDSEntry entry;
-                ret = createUDSEntry ( *ptr, subPath, entry, error );
-                _proto->listEntry(entry, false);
+                names.append( QString::fromLocal8Bit(*ptr) );
             }
             free(*ptr);
             ptr++;
         }
         free (list);
-        _proto->listEntry(UDSEntry(), true);
+
+        AfcListBatch batch(_proto);
+
+        //names known to the persistent index are answered from it right
+        //away and checked again in the background. This is opt-in with
+        //PersistentIndex=true in the [afc] group of kioslaverc, but an
+        //index created for searching is kept up to date anyway
+        const bool fromIndex = _proto->metaData( QLatin1String("PersistentIndex") ) == QLatin1String("true");
+        AfcIndex* persistent = index(fromIndex);
+        AfcIndex::ItemList known;
+        AfcIndex::ItemList current;
+        bool revalidate = false;
+        if ( fromIndex && persistent->lookup(path, known) )
+        {
+            QHash<QString, int> positions;
+            for (int i = 0; i < known.size(); i++)
+                positions.insert(known.at(i).name, i);
+
+            QStringList missing;
+            foreach ( const QString& name, names )
+            {
+                if ( positions.contains(name) )
+                {
+                    current.append( known.at( positions.value(name) ) );
+                    batch.append( AfcIndex::toUDSEntry( current.last() ) );
+                }
+                else
+                {
+                    missing.append(name);
+                }
+            }
+            names = missing;
+            revalidate = true;
+        }
+
+        //stat the entries over several connections, small folders are not
+        //worth the extra handshakes
+        AfcDirLister lister(_pool, _afc, path, names);
+        lister.start( qMin( AFC_MAX_STAT_WORKERS, names.size() / AFC_ENTRIES_PER_STAT_WORKER ) );
+
+        QString subPath;
+        UDSEntry entry;
+        while ( lister.next(subPath, entry, err) )
+        {
+            //KIO usually stats what was just listed
+            _metaCache.insert(subPath, entry, err);
+            if ( AFC_E_SUCCESS == err )
+            {
+                batch.append(entry);
+                current.append( AfcIndex::fromUDSEntry(entry) );
+            }
+            entry.clear();
+        }
+        batch.finish();
+
+        if ( NULL != persistent )
+            persistent->update(path, current);
+
+        //queued only now, our update still holds stale items and must not
+        //overwrite the fresh ones of the background refresh
+        if ( revalidate )
+            _indexUpdater->refresh(path);
     }
     return ret;
 }
@@ -431,7 +1020,29 @@ bool AfcDevice::open( const QString& path, QIODevice::OpenMode mode, KIO::Error&
 {
     kDebug(KIO_AFC) << path << "mode: " << mode;
 
+    if ( !connect(error) )
+        return false;
+
     bool ret = false;
+    if ( openFile(path, mode, error) )
+    {
+        UDSEntry entry;
+        if ( createUDSEntry("", path, entry, error) )
+        {
+            ret = true;
+            _proto->totalSize( entry.numberValue(UDSEntry::UDS_SIZE, 0) );
+            _proto->position( 0 );
+        }
+        else
+        {
+            close();
+        }
+    }
+    return ret;
+}
+
+bool AfcDevice::openFile( const QString& path, QIODevice::OpenMode mode, KIO::Error& error )
+{
     afc_file_mode_t file_mode = AFC_FOPEN_RDONLY;
 
     if ( QIODevice::ReadOnly == mode )
@@ -464,43 +1075,53 @@ bool AfcDevice::open( const QString& path, QIODevice::OpenMode mode, KIO::Error&
         return false;
     }
 
-    afc_error_t err = afc_file_open(_afc, (const char*) path.toLocal8Bit(), file_mode, &openFd);
+    afc_error_t err = afc_file_open(_afc, (const char*) nativePath(path), file_mode, &openFd);
 
-    if ( checkError(err, error) )
+    if ( !checkError(err, error) )
     {
-        openPath = path;
-        UDSEntry entry;
-        if ( createUDSEntry("", path, entry, error) )
-        {
-            ret = true;
-            _proto->totalSize( entry.numberValue(UDSEntry::UDS_SIZE, 0) );
-            _proto->position( 0 );
-        }
+        openFd = -1;
+        return false;
     }
-    return ret;
+
+    openPath = path;
+    openPos = 0;
+    fdPos = 0;
+    _readCache = new AfcReadCache(_afc, openFd);
+    return true;
 }
 
 bool AfcDevice::read( KIO::filesize_t size, KIO::Error& error )
 {
     bool ret = true;
-    Q_ASSERT(openFd != -1);
+    Q_ASSERT(openFd != (uint64_t)-1);
 
-    QVarLengthArray<char> buffer(size);
-    while (true) {
+    if ( !flush(error) )
+        return false;
+
+    //read through a fixed size buffer so memory use does not depend on file size
+    const uint32_t chunk = chunkSize();
+    if ( _buffer.size() < (int) chunk )
+        _buffer.resize( chunk );
+
+    while ( size > 0 )
+    {
+        const uint32_t toRead = (uint32_t) qMin( size, (KIO::filesize_t) chunk );
         uint32_t bytes_read = 0;
-        afc_error_t  err;
-        do {
-            err = afc_file_read(_afc, openFd, buffer.data(), size, &bytes_read);
-        } while (bytes_read < size && checkError(err, error));
-
-        if (bytes_read > 0) {
-            QByteArray array = QByteArray::fromRawData(buffer.data(), bytes_read);
-            _proto->data( array );
+        afc_error_t err = _readCache->read(openPos, _buffer.data(), toRead, bytes_read);
+        //the cache moves the device file position on its own
+        fdPos = -1;
+
+        if (bytes_read > 0)
+        {
+            _proto->data( QByteArray::fromRawData(_buffer.constData(), bytes_read) );
+            openPos += bytes_read;
             size -= bytes_read;
-        } else {
+        }
+        else
+        {
             // empty array designates eof
             _proto->data(QByteArray());
-            if (err != AFC_E_END_OF_DATA)
+            if ( err != AFC_E_SUCCESS && err != AFC_E_END_OF_DATA )
             {
                 ret = false;
                 error = KIO::ERR_COULD_NOT_READ;
@@ -508,88 +1129,912 @@ bool AfcDevice::read( KIO::filesize_t size, KIO::Error& error )
             }
             break;
         }
-        if (size <= 0) break;
     }
     return ret;
 }
 
-bool AfcDevice::write( const QByteArray &data, KIO::Error& error )
+template <class Writer>
+static int pushLocalFile( int fd, Writer& writer, uint32_t chunkSize, KIO::filesize_t& processed, AfcProtocol* proto )
 {
-    bool ret = false;
-    Q_ASSERT( openFd != -1 );
+    QByteArray buffer( chunkSize, Qt::Uninitialized );
 
-    uint32_t bytes_written = 0;
-    afc_error_t err = afc_file_write (_afc, openFd, data.constData(), data.size(), &bytes_written);
+    while ( true )
+    {
+        //a killed job stops as if the writer had refused data, the caller
+        //checks wasKilled() before trying to recover
+        if ( proto->wasKilled() )
+            return 1;
+
+        const ssize_t n = ::read( fd, buffer.data(), buffer.size() );
+        if ( n < 0 && errno == EINTR )
+            continue;
+        if ( n <= 0 )
+            return n;
+
+        //the writer keeps its own copy of the data, even when it refuses it
+        if ( !writer.push( QByteArray( buffer.constData(), n ) ) )
+        {
+            processed += n;
+            return 1;
+        }
 
-    if ( checkError(err, error) )
+        processed += n;
+        proto->processedSize( processed );
+    }
+}
+
+bool AfcDevice::copyToFile( const QString& path, const QString& localPath, int permissions, KIO::JobFlags flags, KIO::Error& error )
+{
+    kDebug(KIO_AFC) << path << "to" << localPath;
+
+    if ( !connect(error) )
+        return false;
+
+    UDSEntry entry;
+    if ( !createUDSEntry( "", path, entry, error ) )
+        return false;
+
+    if ( S_ISDIR( entry.numberValue(UDSEntry::UDS_FILE_TYPE) ) )
     {
-        ret = true;
-        _proto->written(data.size());
+        error = KIO::ERR_IS_DIRECTORY;
+        return false;
+    }
+
+    const QByteArray localName = QFile::encodeName(localPath);
+    KDE_struct_stat buff;
+    if ( KDE_stat( localName, &buff ) == 0 )
+    {
+        if ( S_ISDIR( buff.st_mode ) )
+        {
+            error = KIO::ERR_DIR_ALREADY_EXIST;
+            return false;
+        }
+        if ( !(flags & KIO::Overwrite) )
+        {
+            error = KIO::ERR_FILE_ALREADY_EXIST;
+            return false;
+        }
+    }
+
+    const int fd = KDE_open( localName, O_WRONLY | O_CREAT | O_TRUNC, permissions == -1 ? 0666 : permissions );
+    if ( fd < 0 )
+    {
+        error = ( errno == EACCES ) ? KIO::ERR_WRITE_ACCESS_DENIED : KIO::ERR_CANNOT_OPEN_FOR_WRITING;
+        return false;
+    }
+
+    const KIO::filesize_t size = entry.numberValue(UDSEntry::UDS_SIZE);
+    _proto->totalSize( size );
+
+    //reserve the space up front, the file then ends up in one piece
+#ifdef HAVE_POSIX_FALLOCATE
+    if ( size > 0 && posix_fallocate( fd, 0, size ) == ENOSPC )
+    {
+        ::close( fd );
+        ::unlink( localName );
+        error = KIO::ERR_DISK_FULL;
+        return false;
+    }
+#endif
+#ifdef HAVE_POSIX_FADVISE
+    posix_fadvise( fd, 0, 0, POSIX_FADV_SEQUENTIAL );
+#endif
+
+    //a connection lost on the way is opened again, and the copy goes on
+    //from what was already saved
+    int writeError = 0;
+    KIO::filesize_t processed = 0;
+    afc_error_t err;
+    while ( AFC_E_SUCCESS != ( err = sendFile(path, size, processed, fd, writeError) ) && !writeError && reconnect(err) )
+        kDebug(KIO_AFC) << "going on with" << path << "at" << processed;
+
+    bool ret = true;
+    if ( writeError )
+    {
+        error = ( writeError == ENOSPC ) ? KIO::ERR_DISK_FULL : KIO::ERR_COULD_NOT_WRITE;
+        ret = false;
+    }
+    else if ( !checkError( err, error ) )
+    {
+        ret = false;
+    }
+
+    //the file was preallocated to the full size, a short read from the
+    //device must not pass for a complete copy
+    if ( ret && processed != size )
+    {
+        kDebug(KIO_AFC) << "short read" << processed << "of" << size;
+        error = KIO::ERR_COULD_NOT_READ;
+        ret = false;
+    }
+
+    if ( ::close( fd ) != 0 && ret )
+    {
+        error = KIO::ERR_COULD_NOT_WRITE;
+        ret = false;
+    }
+
+    if ( !ret )
+    {
+        ::unlink( localName );
+        return false;
+    }
+
+    //keep the modification time of the device file
+    const time_t mtime = entry.numberValue( UDSEntry::UDS_MODIFICATION_TIME, 0 );
+    if ( mtime > 0 )
+    {
+        struct utimbuf times;
+        times.actime = mtime;
+        times.modtime = mtime;
+        ::utime( localName, &times );
+    }
+    return true;
+}
+
+bool AfcDevice::copyFromFile( const QString& localPath, const QString& path, int permissions, KIO::JobFlags flags, KIO::Error& error )
+{
+    Q_UNUSED(permissions); //AFC has no permissions
+    kDebug(KIO_AFC) << localPath << "to" << path;
+
+    if ( !connect(error) )
+        return false;
+
+    const QByteArray localName = QFile::encodeName(localPath);
+    KDE_struct_stat buff;
+    if ( KDE_stat( localName, &buff ) != 0 )
+    {
+        error = ( errno == EACCES ) ? KIO::ERR_ACCESS_DENIED : KIO::ERR_DOES_NOT_EXIST;
+        return false;
+    }
+    if ( S_ISDIR( buff.st_mode ) )
+    {
+        error = KIO::ERR_IS_DIRECTORY;
+        return false;
+    }
+
+    if ( !(flags & KIO::Overwrite) )
+    {
+        UDSEntry entry;
+        if ( createUDSEntry( "", path, entry, error ) )
+        {
+            if ( S_ISDIR ( entry.numberValue(UDSEntry::UDS_FILE_TYPE ) ) )
+                error = KIO::ERR_DIR_ALREADY_EXIST;
+            else
+                error = KIO::ERR_FILE_ALREADY_EXIST;
+            return false;
+        }
+        if ( KIO::ERR_DOES_NOT_EXIST != error )
+            return false;
+    }
+
+    const KIO::filesize_t size = buff.st_size;
+    if ( !hasRoomFor( path, size, flags & KIO::Overwrite ) )
+    {
+        error = KIO::ERR_DISK_FULL;
+        return false;
+    }
+    _proto->totalSize( size );
+
+    if ( !uploadFile( localName, path, size, 0, error ) )
+        return false;
+
+    KIO::Error ignored;
+    setModificationTime( path, QDateTime::fromTime_t( buff.st_mtime ), ignored );
+    return true;
+}
+
+bool AfcDevice::uploadFile( const QByteArray& localName, const QString& path, KIO::filesize_t size, KIO::filesize_t processed, KIO::Error& error )
+{
+    const int fd = KDE_open( localName, O_RDONLY );
+    if ( fd < 0 )
+    {
+        error = KIO::ERR_CANNOT_OPEN_FOR_READING;
+        return false;
+    }
+#ifdef HAVE_POSIX_FADVISE
+    posix_fadvise( fd, 0, 0, POSIX_FADV_SEQUENTIAL );
+#endif
+
+    if ( !openFile(path, QIODevice::ReadWrite | QIODevice::Truncate, error) || !preallocate(path, size, error) )
+    {
+        ::close( fd );
+        return false;
+    }
+
+    int result = 1;
+    KIO::filesize_t base = 0;
+    AfcWriter* writer = NULL;
+    afc_error_t err = AFC_E_SUCCESS;
+    bool finished = false;
+    bool failed = false;
+
+    AfcParallelWriter* parallel = NULL;
+    if ( transferConnections(size) > 1 )
+    {
+        parallel = new AfcParallelWriter(_pool, path, chunkSize(), transferConnections(size));
+        if ( !parallel->start() )
+        {
+            delete parallel;
+            parallel = NULL;
+        }
+    }
+
+    if ( NULL != parallel )
+    {
+        result = pushLocalFile( fd, *parallel, chunkSize(), processed, _proto );
+        if ( result < 0 )
+        {
+            parallel->abort();
+        }
+        else if ( result == 0 && parallel->finish() )
+        {
+            finished = true;
+        }
+        else
+        {
+            failed = !recoverParallel( path, parallel, err, base, writer );
+        }
+        delete parallel;
     }
     else
     {
-        _proto->close();
+        writer = new AfcWriter(_afc, openFd);
+        writer->start();
     }
-    return ret;
+
+    //a connection lost on the way is opened again, the local file is read
+    //on from where it was
+    while ( result > 0 && !failed )
+    {
+        result = pushLocalFile( fd, *writer, chunkSize(), processed, _proto );
+        if ( result > 0 )
+            failed = _proto->wasKilled() || !recoverWriter( path, writer, base, err );
+    }
+
+    //a writer that could not be recovered is already gone
+    if ( NULL != writer )
+    {
+        if ( result != 0 )
+            writer->abort();
+        while ( !( finished = writer->finish() ) && result == 0 && recoverWriter( path, writer, base, err ) )
+            ;
+    }
+    if ( NULL != writer )
+    {
+        if ( !finished )
+            err = writer->error();
+        delete writer;
+    }
+
+    ::close( fd );
+    close();
+    invalidate(path);
+
+    //no partial copy is left behind, it would still have its full
+    //preallocated size
+    if ( ( result < 0 || !finished ) && isValid() )
+        afc_remove_path( _afc, (const char*) nativePath(path) );
+
+    if ( result < 0 )
+    {
+        error = KIO::ERR_COULD_NOT_READ;
+        return false;
+    }
+    if ( !finished )
+    {
+        if ( AFC_E_SUCCESS == err || checkError( err, error ) )
+            error = KIO::ERR_ABORTED;
+        return false;
+    }
+    return true;
 }
 
-bool AfcDevice::seek( KIO::filesize_t offset, KIO::Error& error )
+AfcWriter* AfcDevice::startUpload( const QString& path, int maxQueued, KIO::Error& error )
 {
-    bool ret = false;
-    Q_ASSERT( openFd != -1 );
+    if ( !connect(error) )
+        return NULL;
 
-    afc_error_t er = afc_file_seek (_afc, openFd, offset, SEEK_SET);
+    if ( !openFile(path, QIODevice::ReadWrite | QIODevice::Truncate, error) )
+        return NULL;
 
-    if ( checkError(er, error) )
+    AfcWriter* writer = new AfcWriter(_afc, openFd, maxQueued);
+    writer->start();
+    return writer;
+}
+
+bool AfcDevice::finishUpload( AfcWriter* writer, const QDateTime& mtime, KIO::Error& error )
+{
+    const bool finished = writer->finish();
+    const afc_error_t err = writer->error();
+    delete writer;
+
+    const QString path = openPath;
+    close();
+
+    if ( !finished )
     {
-        ret = true;
-        _proto->position( offset );
+        //no partial copy is left behind
+        afc_remove_path( _afc, (const char*) nativePath(path) );
+        invalidate(path);
+
+        if ( !checkError( err, error ) )
+            return false;
+        error = KIO::ERR_ABORTED;
+        return false;
+    }
+
+    KIO::Error ignored;
+    setModificationTime( path, mtime, ignored );
+    return true;
+}
+
+bool AfcDevice::recoverWriter( const QString& path, AfcWriter*& writer, KIO::filesize_t& base, afc_error_t& err )
+{
+    //what did not reach the device is written again over the new
+    //connection, after dropping a possibly half written chunk
+    const QList<QByteArray> pending = writer->takePending();
+    base += writer->written();
+    err = writer->error();
+    return resumeWriter( path, err, base, pending, writer );
+}
+
+bool AfcDevice::recoverParallel( const QString& path, AfcParallelWriter*& parallel, afc_error_t& err, KIO::filesize_t& base, AfcWriter*& writer )
+{
+    //the parallel writer holds connections of the pool, it has to be gone
+    //before reconnecting. The upload goes on over a single connection from
+    //the first byte the device did not acknowledge
+    QList<QByteArray> pending;
+    base = parallel->takePending(pending);
+    err = parallel->error();
+    delete parallel;
+    parallel = NULL;
+    return resumeWriter( path, err, base, pending, writer );
+}
+
+bool AfcDevice::resumeWriter( const QString& path, afc_error_t& err, KIO::filesize_t& base, QList<QByteArray> pending, AfcWriter*& writer )
+{
+    while ( reconnect( err ) )
+    {
+        kDebug(KIO_AFC) << "going on with" << path << "at" << base;
+
+        KIO::Error error;
+        if ( !openFile(path, QIODevice::ReadWrite, error)
+             || AFC_E_SUCCESS != ( err = afc_file_truncate(_afc, openFd, base) )
+             || AFC_E_SUCCESS != ( err = afc_file_seek(_afc, openFd, base, SEEK_SET) ) )
+            break;
+
+        delete writer;
+        writer = new AfcWriter(_afc, openFd, qMax( 4, pending.size() ));
+        writer->start();
+
+        int i = 0;
+        while ( i < pending.size() && writer->push( pending.at(i) ) )
+            i++;
+        if ( i == pending.size() )
+            return true;
+
+        //lost again, the refused chunk is already with the pending ones
+        pending = writer->takePending() + pending.mid(i + 1);
+        base += writer->written();
+        err = writer->error();
+    }
+
+    //given up, what reached the device is already counted in base
+    delete writer;
+    writer = NULL;
+    return false;
+}
+
+void AfcDevice::setModificationTimeFromMetaData( const QString& path )
+{
+    const QString mtimeStr = _proto->metaData(QLatin1String("modified"));
+    if ( !mtimeStr.isEmpty() )
+    {
+        QDateTime dt = QDateTime::fromString( mtimeStr, Qt::ISODate );
+        if ( dt.isValid() )
+        {
+            KIO::Error error;
+            setModificationTime(path, dt, error);
+            //do not trigger error just for time
+        }
+    }
+}
+
+int AfcDevice::transferConnections( KIO::filesize_t size ) const
+{
+    //add a connection per 64 MiB, up to four or up to Connections=<n> in
+    //the [afc] group of kioslaverc. Small files never use more than one
+    bool ok = false;
+    int count = _proto->metaData( QLatin1String("Connections") ).toInt( &ok );
+    if ( !ok )
+        count = AFC_DEFAULT_TRANSFER_CONNECTIONS;
+    count = qBound( 1, count, AFC_MAX_TRANSFER_CONNECTIONS );
+
+    return (int) qMin( size / AFC_BYTES_PER_CONNECTION, (KIO::filesize_t) count );
+}
+
+uint32_t AfcDevice::chunkSize() const
+{
+    //can be tuned with ChunkSize=<bytes> in the [afc] group of kioslaverc
+    bool ok = false;
+    uint32_t size = _proto->metaData( QLatin1String("ChunkSize") ).toUInt( &ok );
+    if ( !ok )
+        return AFC_DEFAULT_CHUNK_SIZE;
+    return qBound( (uint32_t) AFC_MIN_CHUNK_SIZE, size, (uint32_t) AFC_MAX_CHUNK_SIZE );
+}
+
+bool AfcDevice::write( const QByteArray &data, KIO::Error& error )
+{
+    Q_ASSERT( openFd != (uint64_t)-1 );
+
+    //seek() and read() only move our own position, catch up before writing
+    if ( _writeBuffer.isEmpty() && fdPos != openPos )
+    {
+        if ( !checkError( afc_file_seek(_afc, openFd, openPos, SEEK_SET), error ) )
+            return false;
+        fdPos = openPos;
+    }
+    _readCache->clear();
+
+    //small writes are coalesced and sent to the device once a chunk is full
+    if ( _writeBuffer.isEmpty() && (uint32_t) data.size() >= chunkSize() )
+    {
+        uint32_t bytes_written = 0;
+        afc_error_t err = afc_file_write (_afc, openFd, data.constData(), data.size(), &bytes_written);
+        if ( !checkError(err, error) )
+            return false;
+        fdPos += data.size();
     }
     else
     {
-        error = KIO::ERR_COULD_NOT_SEEK;
-        _proto->close();
+        _writeBuffer.append( data );
+        if ( (uint32_t) _writeBuffer.size() >= chunkSize() && !flush(error) )
+            return false;
     }
-    return ret;
+
+    openPos += data.size();
+    _proto->written(data.size());
+    return true;
+}
+
+bool AfcDevice::flush( KIO::Error& error )
+{
+    if ( _writeBuffer.isEmpty() )
+        return true;
+
+    Q_ASSERT( openFd != (uint64_t)-1 );
+
+    uint32_t bytes_written = 0;
+    afc_error_t err = afc_file_write (_afc, openFd, _writeBuffer.constData(), _writeBuffer.size(), &bytes_written);
+    fdPos += _writeBuffer.size();
+    _writeBuffer.clear();
+
+    return checkError(err, error);
+}
+
+bool AfcDevice::seek( KIO::filesize_t offset, KIO::Error& error )
+{
+    Q_ASSERT( openFd != (uint64_t)-1 );
+
+    if ( !flush(error) )
+        return false;
+
+    //no round trip here, the next read or write positions the device file
+    openPos = offset;
+    _proto->position( offset );
+    return true;
 }
 
 bool AfcDevice::close()
 {
-    Q_ASSERT( openFd != -1 );
+    Q_ASSERT( openFd != (uint64_t)-1 );
+
+    KIO::Error error;
+    const bool ret = flush(error);
+
+    delete _readCache;
+    _readCache = NULL;
 
     afc_file_close (_afc, openFd);
+    invalidate(openPath);
     openFd = -1;
     openPath = "";
-    return true;
+    return ret;
 }
 
 bool AfcDevice::mkdir( const QString& path, KIO::Error& error )
 {
-    afc_error_t er = afc_make_directory ( _afc, (const char*) path.toLocal8Bit() );
+    if ( !connect(error) )
+        return false;
+
+    afc_error_t er = afc_make_directory ( _afc, (const char*) nativePath(path) );
+    invalidate(path);
     return checkError(er, error);
 }
 
 bool AfcDevice::setModificationTime( const QString& path, const QDateTime& mtime, KIO::Error& error )
 {
-    afc_error_t er = afc_set_file_time ( _afc, (const char*) path.toLocal8Bit(), mtime.toTime_t() * 1000000000 );
+    if ( !connect(error) )
+        return false;
+
+    afc_error_t er = afc_set_file_time ( _afc, (const char*) nativePath(path), mtime.toTime_t() * 1000000000 );
+    invalidate(path);
     return checkError(er, error);
 }
 
 bool AfcDevice::del( const QString& path, KIO::Error& error)
 {
-    afc_error_t er = afc_remove_path ( _afc, (const char*) path.toLocal8Bit() );
+    if ( !connect(error) )
+        return false;
+
+    afc_error_t er = afc_remove_path ( _afc, (const char*) nativePath(path) );
+
+    //deleteRecursive is advertised, so KIO expects whole trees to go at once
+    if ( AFC_E_DIR_NOT_EMPTY == er )
+        er = removeTree(path);
+
+    invalidateTree(path);
     return checkError(er, error);
 }
 
-bool AfcDevice::rename( const QString& src, const QString& dest, KIO::JobFlags flags, KIO::Error& error )
+bool AfcDevice::freeSpace( KIO::filesize_t& total, KIO::filesize_t& available, KIO::Error& error )
+{
+    if ( !connect(error) )
+        return false;
+
+    if ( time(NULL) - _freeSpaceStamp > AFC_FREE_SPACE_TTL )
+    {
+        char** infos = NULL;
+        if ( !checkError( afc_get_device_info(_afc, &infos), error ) )
+            return false;
+
+        for ( char** ptr = infos; NULL != ptr && NULL != *ptr; ptr += 2 )
+        {
+            if ( NULL == *(ptr + 1) )
+            {
+                free(*ptr);
+                break;
+            }
+            if ( 0 == strcmp(*ptr, "FSTotalBytes") )
+                _freeSpaceTotal = strtoull(*(ptr + 1), NULL, 10);
+            else if ( 0 == strcmp(*ptr, "FSFreeBytes") )
+                _freeSpaceAvailable = strtoull(*(ptr + 1), NULL, 10);
+            free(*ptr);
+            free(*(ptr + 1));
+        }
+        free(infos);
+        _freeSpaceStamp = time(NULL);
+    }
+
+    total = _freeSpaceTotal;
+    available = _freeSpaceAvailable;
+    return true;
+}
+
+bool AfcDevice::hasRoomFor( const QString& path, KIO::filesize_t size, bool overwrite )
+{
+    KIO::filesize_t total;
+    KIO::filesize_t available;
+    KIO::Error error;
+    if ( !freeSpace(total, available, error) )
+        return true; //let the upload find out
+
+    //the file being replaced gives its room back
+    UDSEntry entry;
+    if ( overwrite && size > available && createUDSEntry("", path, entry, error) )
+        available += entry.numberValue(UDSEntry::UDS_SIZE, 0);
+
+    return size <= available;
+}
+
+bool AfcDevice::preallocate( const QString& path, KIO::filesize_t size, KIO::Error& error )
+{
+    if ( 0 == size )
+        return true;
+
+    //reserving the room up front stops a full device right away rather
+    //than after most of the data was sent
+    const afc_error_t er = afc_file_truncate(_afc, openFd, size);
+    if ( AFC_E_NO_SPACE_LEFT == er )
+    {
+        close();
+        afc_remove_path(_afc, (const char*) nativePath(path));
+        invalidate(path);
+        error = KIO::ERR_DISK_FULL;
+        return false;
+    }
+    return true;
+}
+
+bool AfcDevice::directorySize( const QString& path, KIO::Error& error )
+{
+    if ( !connect(error) )
+        return false;
+
+    AfcSizeWalker walker(_pool, _afc, AFC_MAX_STAT_WORKERS, _proto);
+    if ( !checkError( walker.walk(path), error ) )
+        return false;
+
+    _proto->setMetaData( "total-size", QString::number( walker.totalSize() ) );
+    _proto->setMetaData( "files", QString::number( walker.files() ) );
+    _proto->setMetaData( "directories", QString::number( walker.directories() ) );
+    _proto->setMetaData( "skipped", QString::number( walker.skipped() ) );
+    return true;
+}
+
+//true if one of the folders above name is in removed
+static bool isBelow( const QString& name, const QSet<QString>& removed )
+{
+    for ( int slash = name.indexOf('/'); slash > 0; slash = name.indexOf('/', slash + 1) )
+    {
+        if ( removed.contains( name.left(slash) ) )
+            return true;
+    }
+    return false;
+}
+
+bool AfcDevice::sync( const QString& localPath, const QString& path, int flags, KIO::Error& error )
+{
+    kDebug(KIO_AFC) << localPath << "to" << path << "flags" << flags;
+
+    if ( !connect(error) )
+        return false;
+
+    UDSEntry entry;
+    if ( createUDSEntry("", path, entry, error) )
+    {
+        if ( !S_ISDIR( entry.numberValue(UDSEntry::UDS_FILE_TYPE) ) )
+        {
+            error = KIO::ERR_IS_FILE;
+            return false;
+        }
+    }
+    else if ( KIO::ERR_DOES_NOT_EXIST != error || !mkdir(path, error) )
+    {
+        return false;
+    }
+
+    //both trees are walked at the same time
+    AfcLocalScanner local(localPath);
+    local.start();
+    AfcRemoteScanner remote(_pool, _afc, AFC_MAX_STAT_WORKERS);
+    const afc_error_t walked = remote.scan(path);
+    local.wait();
+
+    if ( !local.isValid() )
+    {
+        error = KIO::ERR_DOES_NOT_EXIST;
+        return false;
+    }
+    if ( !checkError( walked, error ) )
+        return false;
+
+    const QString localRoot = localPath.endsWith('/') ? localPath : localPath + '/';
+    const QString root = path.compare("/") ? path + '/' : path;
+    const AfcSyncTree& localTree = local.tree();
+    const AfcSyncTree& remoteTree = remote.tree();
+
+    KIO::filesize_t skippedBytes = 0;
+    KIO::filesize_t totalBytes = 0;
+    int skippedFiles = 0;
+    int deletedFiles = 0;
+
+    //parents sort before their children
+    QStringList names = localTree.keys();
+    names.sort();
+
+    QStringList uploads;
+    KIO::filesize_t replacedBytes = 0;
+    foreach ( const QString& name, names )
+    {
+        const AfcIndex::Item& item = localTree[name];
+        if ( !S_ISREG(item.type) )
+            continue;
+
+        AfcSyncTree::const_iterator it = remoteTree.constFind(name);
+        if ( it != remoteTree.constEnd() && S_ISREG(it->type) && it->size == item.size )
+        {
+            bool same = it->mtime == item.mtime;
+            if ( !same && (flags & AFC_SYNC_CHECKSUM) )
+            {
+                const QByteArray digest = afcLocalDigest( localRoot + name );
+                same = !digest.isEmpty() && digest == afcRemoteDigest( _afc, root + name, chunkSize() );
+                if ( same )
+                {
+                    KIO::Error ignored;
+                    setModificationTime( root + name, QDateTime::fromTime_t( item.mtime ), ignored );
+                }
+            }
+            if ( same )
+            {
+                skippedBytes += item.size;
+                skippedFiles++;
+                continue;
+            }
+        }
+        uploads.append(name);
+        totalBytes += item.size;
+
+        //the old version frees its room when it is replaced
+        if ( it != remoteTree.constEnd() && S_ISREG(it->type) )
+            replacedBytes += it->size;
+    }
+
+    //extraneous entries go first, that frees room and clears the way
+    //for entries changing type. Only the top of a removed tree is deleted,
+    //siblings like "a b" sort between "a" and "a/x" so every parent of a
+    //name is checked
+    QStringList remoteNames = remoteTree.keys();
+    remoteNames.sort();
+    QSet<QString> removed;
+    foreach ( const QString& name, remoteNames )
+    {
+        if ( isBelow( name, removed ) )
+            continue;
+
+        const AfcIndex::Item& item = remoteTree[name];
+        AfcSyncTree::const_iterator it = localTree.constFind(name);
+        const bool extraneous = it == localTree.constEnd();
+        if ( extraneous ? !(flags & AFC_SYNC_DELETE) : (it->type & S_IFMT) == (item.type & S_IFMT) )
+            continue;
+
+        if ( !del( root + name, error ) )
+            return false;
+        removed.insert(name);
+        if ( extraneous )
+            deletedFiles++;
+    }
+
+    foreach ( const QString& name, names )
+    {
+        if ( !S_ISDIR( localTree[name].type ) )
+            continue;
+        AfcSyncTree::const_iterator it = remoteTree.constFind(name);
+        if ( it != remoteTree.constEnd() && S_ISDIR(it->type) )
+            continue;
+        if ( !mkdir( root + name, error ) )
+            return false;
+    }
+
+    KIO::filesize_t total;
+    KIO::filesize_t available;
+    KIO::Error ignored;
+    if ( freeSpace(total, available, ignored) && totalBytes > available + replacedBytes )
+    {
+        error = KIO::ERR_DISK_FULL;
+        return false;
+    }
+
+    _proto->totalSize( totalBytes );
+
+    KIO::filesize_t processed = 0;
+    foreach ( const QString& name, uploads )
+    {
+        const AfcIndex::Item& item = localTree[name];
+        if ( !uploadFile( QFile::encodeName( localRoot + name ), root + name, item.size, processed, error ) )
+            return false;
+
+        KIO::Error ignored;
+        setModificationTime( root + name, QDateTime::fromTime_t( item.mtime ), ignored );
+        processed += item.size;
+        _proto->processedSize( processed );
+    }
+
+    invalidateTree(path);
+
+    _proto->setMetaData( "bytes-transferred", QString::number( totalBytes ) );
+    _proto->setMetaData( "bytes-skipped", QString::number( skippedBytes ) );
+    _proto->setMetaData( "files-transferred", QString::number( uploads.size() ) );
+    _proto->setMetaData( "files-skipped", QString::number( skippedFiles ) );
+    _proto->setMetaData( "files-deleted", QString::number( deletedFiles ) );
+    _proto->infoMessage( i18np( "%1 file sent", "%1 files sent", uploads.size() ) + ", " +
+                         i18np( "%1 file up to date", "%1 files up to date", skippedFiles ) );
+    return true;
+}
+
+bool AfcDevice::findMatches( const QString& path, const AfcSearchQuery& query, AfcIndex::MatchList& matches, KIO::Error& error )
 {
-    //make sure path exists
-    UDSEntry entry_src;
-    if ( !createUDSEntry("", src, entry_src, error) )
+    if ( !connect(error) )
+        return false;
+
+    UDSEntry entry;
+    if ( !createUDSEntry("", path, entry, error) )
+        return false;
+    if ( !S_ISDIR( entry.numberValue(UDSEntry::UDS_FILE_TYPE) ) )
+    {
+        error = KIO::ERR_IS_FILE;
+        return false;
+    }
+
+    //the device is walked again when no crawl ever completed or the last
+    //one is stale, the crawl fills the index over several connections
+    AfcIndex* searchIndex = index(true);
+    if ( !searchIndex->isComplete() )
     {
+        _proto->infoMessage( i18n("Indexing the device...") );
+        _indexUpdater->crawl();
+        if ( !_indexUpdater->waitForCrawl() )
+        {
+            error = KIO::ERR_COULD_NOT_CONNECT;
+            return false;
+        }
+    }
+
+    searchIndex->search(path, query, matches);
+    return true;
+}
+
+QString AfcDevice::url( const QString& path ) const
+{
+    KUrl url;
+    url.setProtocol("afc");
+    url.setPath( '/' + _id + path );
+    return url.url();
+}
+
+bool AfcDevice::listSearch( const QString& path, const AfcSearchQuery& query, KIO::Error& error )
+{
+    AfcIndex::MatchList matches;
+    if ( !findMatches(path, query, matches, error) )
         return false;
+
+    //names must be unique in a listing, the relative path is and the
+    //entries point to the real file
+    const int skip = path == "/" ? 1 : path.size() + 1;
+
+    AfcListBatch batch(_proto);
+    foreach ( const AfcIndex::Match& match, matches )
+    {
+        UDSEntry entry = AfcIndex::toUDSEntry(match.item);
+        entry.insert( UDSEntry::UDS_NAME, match.path.mid(skip) );
+        entry.insert( UDSEntry::UDS_DISPLAY_NAME, match.item.name );
+        entry.insert( UDSEntry::UDS_URL, url(match.path) );
+        entry.insert( UDSEntry::UDS_TARGET_URL, url(match.path) );
+        batch.append(entry);
     }
+    batch.finish();
+    return true;
+}
+
+bool AfcDevice::search( const QString& path, const AfcSearchQuery& query, KIO::Error& error )
+{
+    AfcIndex::MatchList matches;
+    if ( !findMatches(path, query, matches, error) )
+        return false;
+
+    QByteArray result;
+    foreach ( const AfcIndex::Match& match, matches )
+        result.append( url(match.path).toUtf8() ).append('\n');
+
+    _proto->setMetaData( "matches", QString::number( matches.size() ) );
+    _proto->data(result);
+    _proto->data(QByteArray());
+    return true;
+}
+
+afc_error_t AfcDevice::removeTree( const QString& path )
+{
+#ifdef HAVE_AFC_REMOVE_PATH_AND_CONTENTS
+    //recent devices do the whole job in one request
+    afc_error_t er = afc_remove_path_and_contents ( _afc, (const char*) nativePath(path) );
+    if ( AFC_E_OP_NOT_SUPPORTED != er && AFC_E_UNKNOWN_PACKET_TYPE != er )
+        return er;
+#endif
 
+    kDebug(KIO_AFC) << "removing" << path << "entry by entry";
+
+    AfcTreeRemover remover(_pool, _afc, AFC_MAX_STAT_WORKERS);
+    return remover.remove(path);
+}
+
+bool AfcDevice::rename( const QString& src, const QString& dest, KIO::JobFlags flags, KIO::Error& error )
+{
+    if ( !connect(error) )
+        return false;
+
+    //a missing source is reported by the rename itself, but the device
+    //silently replaces an existing destination so that one is checked
     UDSEntry entry_dest;
     if ( createUDSEntry("", dest, entry_dest, error) )
     {
@@ -605,24 +2050,33 @@ bool AfcDevice::rename( const QString& src, const QString& dest, KIO::JobFlags f
             return false;
         }
     }
+    else if ( KIO::ERR_DOES_NOT_EXIST != error )
+    {
+        return false;
+    }
 
-    afc_error_t er = afc_rename_path ( _afc, (const char*) src.toLocal8Bit(), (const char*) dest.toLocal8Bit() );
+    afc_error_t er = afc_rename_path ( _afc, (const char*) nativePath(src), (const char*) nativePath(dest) );
+    invalidateTree(src);
+    invalidateTree(dest);
 
     return checkError(er, error);
 }
 
 bool AfcDevice::symlink( const QString& src, const QString& dest, KIO::JobFlags flags, KIO::Error& error )
 {
-    //make sure path exists
-    UDSEntry entry_src;
-    if ( !createUDSEntry("", src, entry_src, error) )
-    {
+    if ( !connect(error) )
         return false;
-    }
 
-    UDSEntry entry_dest;
-    if ( createUDSEntry("", dest, entry_dest, error) )
+    //the device refuses to create a link over an existing path, only look
+    //at the destination when that happens
+    afc_error_t er = afc_make_link ( _afc, AFC_SYMLINK, (const char*) nativePath(src), (const char*) nativePath(dest) );
+
+    if ( AFC_E_OBJECT_EXISTS == er )
     {
+        UDSEntry entry_dest;
+        if ( !createUDSEntry("", dest, entry_dest, error) )
+            return false;
+
         if (S_ISDIR( entry_dest.numberValue(UDSEntry::UDS_FILE_TYPE ) ) )
         {
             error = KIO::ERR_DIR_ALREADY_EXIST;
@@ -634,9 +2088,59 @@ bool AfcDevice::symlink( const QString& src, const QString& dest, KIO::JobFlags
             error = KIO::ERR_FILE_ALREADY_EXIST;
             return false;
         }
-    }
 
-    afc_error_t er = afc_make_link ( _afc, AFC_SYMLINK, (const char*) src.toLocal8Bit(), (const char*) dest.toLocal8Bit() );
+        if ( ! del(dest, error) )
+            return false;
+
+        er = afc_make_link ( _afc, AFC_SYMLINK, (const char*) nativePath(src), (const char*) nativePath(dest) );
+    }
+    invalidate(dest);
 
     return checkError(er, error);
 }
+
+static QString parentPath( const QString& path )
+{
+    const int slash = path.lastIndexOf('/');
+    return slash > 0 ? path.left(slash) : QString("/");
+}
+
+void AfcDevice::invalidate( const QString& path )
+{
+    //the mtime and link count of the parent change with its content
+    _freeSpaceStamp = 0;
+    _metaCache.invalidate(path);
+    _metaCache.invalidate( parentPath(path) );
+    if ( NULL != _index )
+        _index->remove(path);
+}
+
+void AfcDevice::invalidateTree( const QString& path )
+{
+    _freeSpaceStamp = 0;
+    _metaCache.invalidateTree(path);
+    _metaCache.invalidate( parentPath(path) );
+    if ( NULL != _index )
+        _index->remove(path);
+}
+
+AfcIndex* AfcDevice::index( bool create )
+{
+    if ( NULL == _index && create )
+        _index = new AfcIndex(_id);
+
+    //the updater is dropped with the connection it was using
+    if ( NULL != _index && NULL == _indexUpdater )
+    {
+        _indexUpdater = new AfcIndexUpdater(_index, _pool);
+
+        if ( !_index->isComplete() )
+            _indexUpdater->crawl();
+    }
+    return _index;
+}
+
+const AfcMetaCache& AfcDevice::metaCache() const
+{
+    return _metaCache;
+}
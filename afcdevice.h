@@ -14,12 +14,24 @@
 #include <libimobiledevice/afc.h>
 
 #include <QtCore/QString>
+#include <QtCore/QByteArray>
+#include <QtCore/QList>
+#include <QtCore/QMutex>
+
+#include "afcmetacache.h"
+#include "afcindex.h"
 
 #include <kio/global.h>
 #include <kio/udsentry.h>
 #include <kio/job.h>
 
 class AfcProtocol;
+class AfcReadCache;
+class AfcClientPool;
+class AfcParallelWriter;
+class AfcWriter;
+class AfcIndexUpdater;
+class AfcSearchQuery;
 
 class AfcDevice
 {
@@ -28,20 +40,49 @@ public:
     virtual ~AfcDevice();
 
     bool isValid();
+    bool connect( KIO::Error& error );
+
+    /** Name given to the device by its owner, empty if not known yet */
+    QString name();
+
+    /**
+     * Called from the device event thread when the device is plugged or
+     * unplugged. The descriptor is kept for a while after unplugging, a
+     * transfer in progress goes on if the device comes back in time.
+     */
+    void setPresent( bool present );
+    bool isPresent() const;
+    /** @return true once the device was away for longer than the grace delay */
+    bool isGone() const;
 
     bool createRootUDSEntry( KIO::UDSEntry & entry );
     bool createUDSEntry( const QString & filename, const QString & path, KIO::UDSEntry & entry, KIO::Error& error );
+    static afc_error_t fillUDSEntry( afc_client_t afc, const QString & filename, const QString & path, KIO::UDSEntry & entry );
+    /** @return true if err means the connection itself is gone */
+    static bool isConnectionLost( afc_error_t err );
 
     bool checkError( afc_error_t err, KIO::Error& error );
 
     bool get(const QString& path, KIO::Error& error);
     bool put( const QString& path, KIO::JobFlags _flags, KIO::Error& error );
 
+    bool copyToFile( const QString& path, const QString& localPath, int permissions, KIO::JobFlags flags, KIO::Error& error );
+    bool copyFromFile( const QString& localPath, const QString& path, int permissions, KIO::JobFlags flags, KIO::Error& error );
+
+    /**
+     * Opens path for writing from another thread, used to send one file
+     * to several devices at once. The upload is completed or cleaned up
+     * by finishUpload().
+     */
+    AfcWriter* startUpload( const QString& path, int maxQueued, KIO::Error& error );
+    bool finishUpload( AfcWriter* writer, const QDateTime& mtime, KIO::Error& error );
+
     bool stat( const QString& filename, const QString& path, KIO::Error& error );
     bool open( const QString& path, QIODevice::OpenMode mode, KIO::Error& error );
     bool read( KIO::filesize_t size, KIO::Error& error );
     bool write( const QByteArray &data, KIO::Error& error );
     bool seek( KIO::filesize_t offset, KIO::Error& error );
+    bool flush( KIO::Error& error );
     bool close();
 
     bool listDir(const QString& path, KIO::Error& error );
@@ -50,11 +91,55 @@ public:
     bool setModificationTime( const QString& path, const QDateTime& mtime, KIO::Error& error );
     bool del( const QString& path, KIO::Error& error);
 
+    bool directorySize( const QString& path, KIO::Error& error );
+
+    /** Size and free room of the device file system, in bytes */
+    bool freeSpace( KIO::filesize_t& total, KIO::filesize_t& available, KIO::Error& error );
+
+    /**
+     * Makes path a copy of the local folder, sending only the new and
+     * changed files. flags is a combination of AfcSyncFlag.
+     */
+    bool sync( const QString& localPath, const QString& path, int flags, KIO::Error& error );
+
+    /** Lists the matches below path as entries named after their relative path */
+    bool listSearch( const QString& path, const AfcSearchQuery& query, KIO::Error& error );
+    /** Sends the urls of the matches below path as data, one per line */
+    bool search( const QString& path, const AfcSearchQuery& query, KIO::Error& error );
+
     bool rename( const QString& src, const QString& dest, KIO::JobFlags flags, KIO::Error& error );
     bool symlink( const QString& src, const QString& dest, KIO::JobFlags flags, KIO::Error& error );
 
+    const AfcMetaCache& metaCache() const;
+    uint32_t chunkSize() const;
+
 
 private:
+    bool openFile( const QString& path, QIODevice::OpenMode mode, KIO::Error& error );
+    KIO::filesize_t resumeOffset( const QString& path, KIO::filesize_t size );
+    bool uploadFile( const QByteArray& localName, const QString& path, KIO::filesize_t size, KIO::filesize_t processed, KIO::Error& error );
+    bool hasRoomFor( const QString& path, KIO::filesize_t size, bool overwrite );
+    bool preallocate( const QString& path, KIO::filesize_t size, KIO::Error& error );
+    void setModificationTimeFromMetaData( const QString& path );
+    int transferConnections( KIO::filesize_t size ) const;
+    afc_error_t removeTree( const QString& path );
+
+    QByteArray nativePath( const QString& path );
+
+    void disconnect();
+    bool reconnect( afc_error_t err );
+    /** Sends path from position to the job, or to the local file fd if not -1 */
+    afc_error_t sendFile( const QString& path, KIO::filesize_t size, KIO::filesize_t& position, int fd, int& writeError );
+    bool recoverWriter( const QString& path, AfcWriter*& writer, KIO::filesize_t& base, afc_error_t& err );
+    bool recoverParallel( const QString& path, AfcParallelWriter*& parallel, afc_error_t& err, KIO::filesize_t& base, AfcWriter*& writer );
+    bool resumeWriter( const QString& path, afc_error_t& err, KIO::filesize_t& base, QList<QByteArray> pending, AfcWriter*& writer );
+    bool findMatches( const QString& path, const AfcSearchQuery& query, AfcIndex::MatchList& matches, KIO::Error& error );
+    QString url( const QString& path ) const;
+
+    void invalidate( const QString& path );
+    void invalidateTree( const QString& path );
+    AfcIndex* index( bool create );
+
     AfcProtocol* _proto;
     idevice_t _dev;
     afc_client_t _afc;
@@ -63,8 +148,42 @@ private:
     QString _name;
     QString _icon;
 
+    //encoded form of the last path sent to the device
+    QString _nativeFor;
+    QByteArray _native;
+
+    //plugged state, updated from the device event thread
+    mutable QMutex _stateMutex;
+    bool _present;
+    bool _lost;
+    time_t _removedAt;
+
     uint64_t openFd;
     QString openPath;
+    //position seen by the application and actual position of openFd
+    KIO::filesize_t openPos;
+    KIO::filesize_t fdPos;
+    AfcReadCache* _readCache;
+
+    //extra connections for parallel work
+    AfcClientPool* _pool;
+
+    AfcMetaCache _metaCache;
+
+    //persistent directory index and its background updater, created
+    //by the first search or listing when PersistentIndex is set
+    AfcIndex* _index;
+    AfcIndexUpdater* _indexUpdater;
+
+    //cached free space, see freeSpace()
+    KIO::filesize_t _freeSpaceTotal;
+    KIO::filesize_t _freeSpaceAvailable;
+    time_t _freeSpaceStamp;
+
+    //reused transfer buffer, at most one chunk big
+    QByteArray _buffer;
+    //pending small writes of the opened file
+    QByteArray _writeBuffer;
 };
 
 #endif // AFCDEVICE_H
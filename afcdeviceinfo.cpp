@@ -0,0 +1,49 @@
+/*
+   Copyright (C) 2010 Jonathan Beck <jonabeck@gmail.com>
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public
+   License (LGPL) as published by the Free Software Foundation;
+   either version 2 of the License, or (at your option) any later
+   version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public License
+   along with this library; see the file COPYING.LIB.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+*/
+
+#include "afcdeviceinfo.h"
+
+#include <kconfig.h>
+#include <kconfiggroup.h>
+
+static const char* s_configName = "kio_afcrc";
+
+bool AfcDeviceInfo::load( const QString& id, QString& name, QString& icon )
+{
+    KConfig config( s_configName, KConfig::SimpleConfig );
+    KConfigGroup group( &config, "Device " + id );
+
+    name = group.readEntry( "Name", QString() );
+    icon = group.readEntry( "Icon", QString() );
+    return !name.isEmpty();
+}
+
+void AfcDeviceInfo::store( const QString& id, const QString& name, const QString& icon )
+{
+    KConfig config( s_configName, KConfig::SimpleConfig );
+    KConfigGroup group( &config, "Device " + id );
+
+    if ( group.readEntry( "Name", QString() ) == name && group.readEntry( "Icon", QString() ) == icon )
+        return;
+
+    group.writeEntry( "Name", name );
+    group.writeEntry( "Icon", icon );
+    config.sync();
+}
@@ -0,0 +1,27 @@
+/***************************************************************************
+ *   Copyright (C) 2010 by Jonathan Beck <jonabeck@gmail.com>              *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ ***************************************************************************/
+
+#ifndef AFCDEVICEINFO_H
+#define AFCDEVICEINFO_H
+
+#include <QtCore/QString>
+
+/**
+ * Names and icons of the devices, learned during a handshake and kept in
+ * kio_afcrc so that other slaves can resolve a device name without a
+ * handshake of their own.
+ */
+class AfcDeviceInfo
+{
+public:
+    static bool load( const QString& id, QString& name, QString& icon );
+    static void store( const QString& id, const QString& name, const QString& icon );
+};
+
+#endif // AFCDEVICEINFO_H
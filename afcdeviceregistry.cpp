@@ -0,0 +1,138 @@
+/*
+   Copyright (C) 2010 Jonathan Beck <jonabeck@gmail.com>
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public
+   License (LGPL) as published by the Free Software Foundation;
+   either version 2 of the License, or (at your option) any later
+   version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public License
+   along with this library; see the file COPYING.LIB.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+*/
+
+#include "afcdeviceregistry.h"
+#include "afcdevice.h"
+
+#include <QtCore/QReadLocker>
+#include <QtCore/QWriteLocker>
+
+#include <kdebug.h>
+
+#define KIO_AFC 7002
+
+AfcDeviceRegistry::AfcDeviceRegistry( AfcProtocol* proto ) :
+        _proto(proto)
+{
+}
+
+AfcDeviceRegistry::~AfcDeviceRegistry()
+{
+}
+
+AfcDeviceHandle AfcDeviceRegistry::find( const QString& id ) const
+{
+    QReadLocker lock(&_lock);
+    return _devices.value(id);
+}
+
+bool AfcDeviceRegistry::resolve( const QString& host, QString& id ) const
+{
+    QReadLocker lock(&_lock);
+
+    //the key is handed out, so every path of a device shares its id
+    QHash<QString, AfcDeviceHandle>::const_iterator it = _devices.constFind(host);
+    if ( it != _devices.constEnd() )
+    {
+        id = it.key();
+        return true;
+    }
+
+    for ( it = _devices.constBegin(); it != _devices.constEnd(); ++it )
+    {
+        if ( it.value()->name() == host )
+        {
+            id = it.key();
+            return true;
+        }
+    }
+    return false;
+}
+
+QList<AfcDeviceHandle> AfcDeviceRegistry::devices() const
+{
+    QReadLocker lock(&_lock);
+    return _devices.values();
+}
+
+QStringList AfcDeviceRegistry::ids() const
+{
+    QReadLocker lock(&_lock);
+
+    QStringList ids;
+    for ( QHash<QString, AfcDeviceHandle>::const_iterator it = _devices.constBegin(); it != _devices.constEnd(); ++it )
+    {
+        if ( it.value()->isPresent() )
+            ids.append( it.key() );
+    }
+    return ids;
+}
+
+void AfcDeviceRegistry::plugged( const QString& id )
+{
+    {
+        QReadLocker lock(&_lock);
+        AfcDevice* device = _devices.value(id).data();
+        if ( NULL != device )
+        {
+            device->setPresent(true);
+            return;
+        }
+    }
+
+    QWriteLocker lock(&_lock);
+    if ( !_devices.contains(id) )
+        _devices.insert( id, AfcDeviceHandle( new AfcDevice( id.toLocal8Bit(), _proto ) ) );
+}
+
+void AfcDeviceRegistry::unplugged( const QString& id )
+{
+    //kept for a while, the device may only be going through a hub
+    //reset and come back
+    QReadLocker lock(&_lock);
+    AfcDevice* device = _devices.value(id).data();
+    if ( NULL != device )
+        device->setPresent(false);
+}
+
+void AfcDeviceRegistry::dropGone()
+{
+    //the handles are released outside of the lock, a device may be
+    //deleted right away if no command uses it
+    QList<AfcDeviceHandle> gone;
+    {
+        QWriteLocker lock(&_lock);
+
+        QHash<QString, AfcDeviceHandle>::iterator it = _devices.begin();
+        while ( it != _devices.end() )
+        {
+            if ( it.value()->isGone() )
+            {
+                kDebug(KIO_AFC) << "forgetting" << it.key();
+                gone.append( it.value() );
+                it = _devices.erase(it);
+            }
+            else
+            {
+                ++it;
+            }
+        }
+    }
+}
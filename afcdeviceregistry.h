@@ -0,0 +1,67 @@
+/***************************************************************************
+ *   Copyright (C) 2010 by Jonathan Beck <jonabeck@gmail.com>              *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ ***************************************************************************/
+
+#ifndef AFCDEVICEREGISTRY_H
+#define AFCDEVICEREGISTRY_H
+
+#include <QtCore/QHash>
+#include <QtCore/QList>
+#include <QtCore/QReadWriteLock>
+#include <QtCore/QSharedPointer>
+#include <QtCore/QString>
+#include <QtCore/QStringList>
+
+class AfcDevice;
+class AfcProtocol;
+
+typedef QSharedPointer<AfcDevice> AfcDeviceHandle;
+
+/**
+ * Devices known to the slave, shared between the dispatch loop and the
+ * device event thread.
+ *
+ * Lookups take the lock for reading only and hand out reference counted
+ * handles: a device dropped from the registry is deleted once the last
+ * command using it is over. The event thread never keeps a handle, so a
+ * device is never deleted there, and it never contacts a device either:
+ * descriptors are cheap and connect on their first use.
+ */
+class AfcDeviceRegistry
+{
+public:
+    AfcDeviceRegistry( AfcProtocol* proto );
+    ~AfcDeviceRegistry();
+
+    /** @return a null handle if the device is not known */
+    AfcDeviceHandle find( const QString& id ) const;
+
+    /**
+     * Finds the id of a device from its id or its name.
+     * @return false if no device matches, id is then left alone
+     */
+    bool resolve( const QString& host, QString& id ) const;
+    QList<AfcDeviceHandle> devices() const;
+    /** ids of the plugged devices */
+    QStringList ids() const;
+
+    /** Called from the device event thread */
+    void plugged( const QString& id );
+    void unplugged( const QString& id );
+
+    /** Forgets the devices unplugged for longer than their grace delay */
+    void dropGone();
+
+private:
+    AfcProtocol* _proto;
+
+    mutable QReadWriteLock _lock;
+    QHash<QString, AfcDeviceHandle> _devices;
+};
+
+#endif // AFCDEVICEREGISTRY_H
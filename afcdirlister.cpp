@@ -0,0 +1,186 @@
+/*
+   Copyright (C) 2010 Jonathan Beck <jonabeck@gmail.com>
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public
+   License (LGPL) as published by the Free Software Foundation;
+   either version 2 of the License, or (at your option) any later
+   version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public License
+   along with this library; see the file COPYING.LIB.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+*/
+
+#include "afcdirlister.h"
+#include "afcclientpool.h"
+#include "afcdevice.h"
+
+#include <QtCore/QThread>
+#include <QtCore/QMutexLocker>
+
+#define BATCH_MAX_ENTRIES 200
+#define BATCH_MAX_DELAY 100
+
+class AfcStatWorker : public QThread
+{
+public:
+    AfcStatWorker( AfcDirLister* lister ) : _lister(lister) {}
+
+protected:
+    virtual void run()
+    {
+        afc_client_t client = _lister->_pool->acquire();
+        _lister->work(client);
+        _lister->_pool->release(client);
+    }
+
+private:
+    AfcDirLister* _lister;
+};
+
+AfcDirLister::AfcDirLister( AfcClientPool* pool, afc_client_t afc, const QString& path, const QStringList& names ) :
+        _pool(pool),
+        _afc(afc),
+        _path(path),
+        _names(names),
+        _nextIndex(0),
+        _running(0)
+{
+}
+
+AfcDirLister::~AfcDirLister()
+{
+    {
+        //make the workers run out of entries
+        QMutexLocker lock(&_mutex);
+        _nextIndex = _names.size();
+    }
+    foreach ( AfcStatWorker* worker, _workers )
+    {
+        worker->wait();
+        delete worker;
+    }
+}
+
+void AfcDirLister::start( int nbWorkers )
+{
+    QMutexLocker lock(&_mutex);
+
+    for (int i = 0; i < nbWorkers; i++)
+    {
+        AfcStatWorker* worker = new AfcStatWorker(this);
+        _workers.append(worker);
+        _running++;
+        worker->start();
+    }
+}
+
+bool AfcDirLister::next( QString& path, KIO::UDSEntry& entry, afc_error_t& err )
+{
+    QMutexLocker lock(&_mutex);
+
+    while ( _results.isEmpty() )
+    {
+        if ( 0 == _running )
+        {
+            //no worker left (or none could connect), finish on our own connection
+            const int index = take();
+            if ( index < 0 )
+                return false;
+
+            lock.unlock();
+            Result result = stat(_afc, index);
+            lock.relock();
+            _results.enqueue(result);
+            break;
+        }
+        _ready.wait(&_mutex);
+    }
+
+    Result result = _results.dequeue();
+    path = result.path;
+    entry = result.entry;
+    err = result.err;
+    return true;
+}
+
+void AfcDirLister::work( afc_client_t client )
+{
+    while ( NULL != client )
+    {
+        int index;
+        {
+            QMutexLocker lock(&_mutex);
+            index = take();
+        }
+        if ( index < 0 )
+            break;
+
+        Result result = stat(client, index);
+
+        QMutexLocker lock(&_mutex);
+        _results.enqueue(result);
+        _ready.wakeOne();
+    }
+
+    QMutexLocker lock(&_mutex);
+    _running--;
+    _ready.wakeOne();
+}
+
+int AfcDirLister::take()
+{
+    if ( _nextIndex >= _names.size() )
+        return -1;
+    return _nextIndex++;
+}
+
+AfcDirLister::Result AfcDirLister::stat( afc_client_t client, int index )
+{
+    const QString& name = _names.at(index);
+    QString subPath = _path.compare("/") ? _path : "";
+    subPath += "/";
+    subPath += name;
+
+    Result result;
+    result.path = subPath;
+    result.err = AfcDevice::fillUDSEntry( client, name, subPath, result.entry );
+    return result;
+}
+
+AfcListBatch::AfcListBatch( KIO::SlaveBase* slave ) : _slave(slave)
+{
+    _timer.start();
+}
+
+void AfcListBatch::append( const KIO::UDSEntry& entry )
+{
+    _entries.append(entry);
+
+    //first entries go out quickly, then in bigger groups
+    if ( _entries.size() >= BATCH_MAX_ENTRIES || _timer.elapsed() >= BATCH_MAX_DELAY )
+        flush();
+}
+
+void AfcListBatch::finish()
+{
+    flush();
+    _slave->listEntry(KIO::UDSEntry(), true);
+}
+
+void AfcListBatch::flush()
+{
+    if ( !_entries.isEmpty() )
+    {
+        _slave->listEntries(_entries);
+        _entries.clear();
+    }
+    _timer.restart();
+}
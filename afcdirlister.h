@@ -0,0 +1,95 @@
+/***************************************************************************
+ *   Copyright (C) 2010 by Jonathan Beck <jonabeck@gmail.com>              *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ ***************************************************************************/
+
+#ifndef AFCDIRLISTER_H
+#define AFCDIRLISTER_H
+
+#include <libimobiledevice/afc.h>
+
+#include <QtCore/QMutex>
+#include <QtCore/QWaitCondition>
+#include <QtCore/QQueue>
+#include <QtCore/QStringList>
+
+#include <QtCore/QTime>
+
+#include <kio/udsentry.h>
+#include <kio/slavebase.h>
+
+class AfcClientPool;
+class AfcStatWorker;
+
+/**
+ * Stats the entries of a directory over several connections of a client
+ * pool. Results are handed back in completion order.
+ */
+class AfcDirLister
+{
+public:
+    AfcDirLister( AfcClientPool* pool, afc_client_t afc, const QString& path, const QStringList& names );
+    ~AfcDirLister();
+
+    void start( int nbWorkers );
+
+    /**
+     * Waits for the next stat result.
+     * @return false once every entry has been returned
+     */
+    bool next( QString& path, KIO::UDSEntry& entry, afc_error_t& err );
+
+private:
+    friend class AfcStatWorker;
+
+    struct Result
+    {
+        QString path;
+        KIO::UDSEntry entry;
+        afc_error_t err;
+    };
+
+    void work( afc_client_t client );
+    int take();
+    Result stat( afc_client_t client, int index );
+
+    AfcClientPool* _pool;
+    afc_client_t _afc;
+    QString _path;
+    QStringList _names;
+
+    QMutex _mutex;
+    QWaitCondition _ready;
+    QQueue<Result> _results;
+    int _nextIndex;
+    int _running;
+
+    QList<AfcStatWorker*> _workers;
+};
+
+/**
+ * Groups listing entries and sends them with listEntries() once enough
+ * entries or enough time have accumulated, so big folders show up
+ * progressively without one message per entry.
+ */
+class AfcListBatch
+{
+public:
+    AfcListBatch( KIO::SlaveBase* slave );
+
+    void append( const KIO::UDSEntry& entry );
+    void finish();
+
+private:
+    void flush();
+
+    KIO::SlaveBase* _slave;
+    KIO::UDSEntryList _entries;
+    QTime _timer;
+};
+
+#endif // AFCDIRLISTER_H
@@ -0,0 +1,216 @@
+/*
+   Copyright (C) 2010 Jonathan Beck <jonabeck@gmail.com>
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public
+   License (LGPL) as published by the Free Software Foundation;
+   either version 2 of the License, or (at your option) any later
+   version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public License
+   along with this library; see the file COPYING.LIB.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+*/
+
+#include "afcfanout.h"
+#include "afcdevice.h"
+#include "afctransfer.h"
+#include "kio_afc.h"
+
+#include <QtCore/QDateTime>
+#include <QtCore/QFile>
+#include <QtCore/QStringList>
+#include <QtCore/QTime>
+
+#include <kde_file.h>
+#include <kdebug.h>
+
+#include <config-kio_afc.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define KIO_AFC 7002
+
+//the chunks are shared between the devices, a deep queue absorbs short
+//hiccups of one device. Past that, all devices go at the pace of the
+//slowest, and one that takes no chunk for a while is dropped
+#define FANOUT_QUEUED_CHUNKS 16
+#define FANOUT_STALL_TIMEOUT 15000 //ms
+#define PROGRESS_INTERVAL 500
+
+AfcFanOut::AfcFanOut( AfcProtocol* proto ) :
+        _proto(proto)
+{
+}
+
+AfcFanOut::~AfcFanOut()
+{
+    for (int i = 0; i < _targets.size(); i++)
+        fail( _targets[i], KIO::ERR_ABORTED );
+}
+
+void AfcFanOut::addTarget( const QString& id, AfcDevice* device, const QString& path )
+{
+    Target target;
+    target.id = id;
+    target.device = device;
+    target.path = path;
+    target.writer = NULL;
+    target.error = KIO::Error(0);
+    _targets.append(target);
+}
+
+void AfcFanOut::fail( Target& target, KIO::Error error )
+{
+    if ( NULL != target.writer )
+    {
+        target.writer->abort();
+        target.device->finishUpload( target.writer, QDateTime(), error );
+        target.writer = NULL;
+    }
+    if ( 0 == target.error )
+        target.error = error;
+}
+
+void AfcFanOut::reportProgress()
+{
+    foreach ( const Target& target, _targets )
+    {
+        if ( NULL != target.writer )
+            _proto->setMetaData( "written-" + target.id, QString::number( target.writer->written() ) );
+    }
+    _proto->sendMetaData();
+}
+
+bool AfcFanOut::send( const QString& localPath, KIO::Error& error )
+{
+    const QByteArray localName = QFile::encodeName(localPath);
+    KDE_struct_stat buff;
+    if ( KDE_stat( localName, &buff ) != 0 )
+    {
+        error = ( errno == EACCES ) ? KIO::ERR_ACCESS_DENIED : KIO::ERR_DOES_NOT_EXIST;
+        return false;
+    }
+    if ( S_ISDIR( buff.st_mode ) )
+    {
+        error = KIO::ERR_IS_DIRECTORY;
+        return false;
+    }
+
+    const int fd = KDE_open( localName, O_RDONLY );
+    if ( fd < 0 )
+    {
+        error = KIO::ERR_CANNOT_OPEN_FOR_READING;
+        return false;
+    }
+#ifdef HAVE_POSIX_FADVISE
+    posix_fadvise( fd, 0, 0, POSIX_FADV_SEQUENTIAL );
+#endif
+
+    uint32_t chunkSize = 0;
+    int active = 0;
+    for (int i = 0; i < _targets.size(); i++)
+    {
+        Target& target = _targets[i];
+        KIO::Error err;
+        target.writer = target.device->startUpload( target.path, FANOUT_QUEUED_CHUNKS, err );
+        if ( NULL == target.writer )
+        {
+            fail( target, err );
+            continue;
+        }
+        chunkSize = target.device->chunkSize();
+        active++;
+    }
+
+    _proto->totalSize( buff.st_size );
+
+    QTime lastReport;
+    lastReport.start();
+    KIO::filesize_t processed = 0;
+    bool readError = false;
+
+    while ( active > 0 )
+    {
+        //every writer keeps a reference to the same buffer
+        QByteArray buffer( chunkSize, Qt::Uninitialized );
+        const ssize_t n = ::read( fd, buffer.data(), buffer.size() );
+        if ( n < 0 && errno == EINTR )
+            continue;
+        if ( n < 0 )
+            readError = true;
+        if ( n <= 0 )
+            break;
+        buffer.resize(n);
+
+        for (int i = 0; i < _targets.size(); i++)
+        {
+            Target& target = _targets[i];
+            if ( NULL != target.writer && !target.writer->push( buffer, FANOUT_STALL_TIMEOUT ) )
+            {
+                const bool stalled = AFC_E_SUCCESS == target.writer->error();
+                kDebug(KIO_AFC) << "dropping" << target.id << ( stalled ? "stalled" : "write failed" );
+                fail( target, stalled ? KIO::ERR_SERVER_TIMEOUT : KIO::ERR_COULD_NOT_WRITE );
+                active--;
+            }
+        }
+
+        processed += n;
+        _proto->processedSize( processed );
+        if ( lastReport.elapsed() > PROGRESS_INTERVAL )
+        {
+            reportProgress();
+            lastReport.restart();
+        }
+    }
+    ::close( fd );
+
+    QStringList sent;
+    QStringList failed;
+    const QDateTime mtime = QDateTime::fromTime_t( buff.st_mtime );
+    for (int i = 0; i < _targets.size(); i++)
+    {
+        Target& target = _targets[i];
+        if ( readError )
+            fail( target, KIO::ERR_COULD_NOT_READ );
+
+        if ( NULL != target.writer )
+        {
+            KIO::Error err;
+            const bool ok = target.device->finishUpload( target.writer, mtime, err );
+            target.writer = NULL;
+            if ( ok )
+            {
+                sent.append( target.id );
+                continue;
+            }
+            target.error = err;
+        }
+
+        failed.append( target.id );
+        _proto->setMetaData( "error-" + target.id, KIO::buildErrorString( target.error, target.path ) );
+    }
+
+    _proto->setMetaData( "sent", sent.join(",") );
+    _proto->setMetaData( "failed", failed.join(",") );
+
+    if ( readError )
+    {
+        error = KIO::ERR_COULD_NOT_READ;
+        return false;
+    }
+    if ( sent.isEmpty() )
+    {
+        error = _targets.isEmpty() ? KIO::ERR_DOES_NOT_EXIST : _targets.first().error;
+        return false;
+    }
+    return true;
+}
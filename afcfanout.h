@@ -0,0 +1,61 @@
+/***************************************************************************
+ *   Copyright (C) 2010 by Jonathan Beck <jonabeck@gmail.com>              *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ ***************************************************************************/
+
+#ifndef AFCFANOUT_H
+#define AFCFANOUT_H
+
+#include <QtCore/QList>
+#include <QtCore/QString>
+
+#include <kio/global.h>
+
+class AfcProtocol;
+class AfcDevice;
+class AfcWriter;
+
+/**
+ * Sends one local file to several devices at once. The file is read a
+ * single time and every chunk is queued, shared, to one writer thread
+ * per device. The devices go at the pace of the slowest one. A device
+ * failing, or taking no data for a while, is dropped while the others
+ * go on.
+ *
+ * Once done, the sent and failed metadata list the ids of the devices,
+ * error-<id> describes each failure. While sending, written-<id> tells
+ * how far each device is.
+ */
+class AfcFanOut
+{
+public:
+    AfcFanOut( AfcProtocol* proto );
+    ~AfcFanOut();
+
+    void addTarget( const QString& id, AfcDevice* device, const QString& path );
+
+    /** @return false if no device got the file */
+    bool send( const QString& localPath, KIO::Error& error );
+
+private:
+    struct Target
+    {
+        QString id;
+        AfcDevice* device;
+        QString path;
+        AfcWriter* writer;
+        KIO::Error error;
+    };
+
+    void fail( Target& target, KIO::Error error );
+    void reportProgress();
+
+    AfcProtocol* _proto;
+    QList<Target> _targets;
+};
+
+#endif // AFCFANOUT_H
@@ -0,0 +1,468 @@
+/*
+   Copyright (C) 2010 Jonathan Beck <jonabeck@gmail.com>
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public
+   License (LGPL) as published by the Free Software Foundation;
+   either version 2 of the License, or (at your option) any later
+   version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public License
+   along with this library; see the file COPYING.LIB.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+*/
+
+#include "afcindex.h"
+#include "kio_afc.h"
+#include "afcsearch.h"
+
+#include <QtCore/QFile>
+#include <QtCore/QMutexLocker>
+#include <QtCore/QStringList>
+#include <QtCore/QVector>
+#include <QtCore/QMap>
+#include <QtCore/QtAlgorithms>
+
+#include <kstandarddirs.h>
+#include <ksavefile.h>
+#include <kdebug.h>
+
+#include <sys/stat.h>
+
+#define KIO_AFC 7002
+
+#define INDEX_MAGIC 0x41464349 // "AFCI"
+#define INDEX_VERSION 2
+#define INDEX_MAX_BYTES (32 * 1024 * 1024)
+#define INDEX_SAVE_INTERVAL 30
+#define INDEX_CRAWL_TTL (24 * 60 * 60)
+
+//on disk layout, all records are 8 bytes aligned
+struct IndexHeader
+{
+    quint32 magic;
+    quint32 version;
+    quint32 dirCount;
+    quint32 itemCount;
+    quint32 stringBytes;
+    quint32 reserved;
+    qint64 crawled;  // end of the last complete crawl, 0 if none
+};
+
+struct IndexDir
+{
+    qint32 parent;   // index of the parent directory, -1 if name is absolute
+    quint32 name;    // offset in the string pool
+    quint32 firstItem;
+    quint32 itemCount;
+    qint64 stamp;
+};
+
+struct IndexItem
+{
+    quint32 name;
+    quint32 type;
+    quint64 size;
+    qint64 mtime;
+};
+
+static qint64 itemBytes( const AfcIndex::Item& item )
+{
+    return sizeof(IndexItem) + item.name.size() + 1;
+}
+
+AfcIndex::AfcIndex( const QString& id ) :
+        _bytes(0),
+        _dirty(false),
+        _lastSave(time(NULL)),
+        _crawled(0),
+        _trimmed(0)
+{
+    _fileName = KStandardDirs::locateLocal( "cache", "kio_afc/" + id + ".index" );
+    load();
+}
+
+AfcIndex::~AfcIndex()
+{
+    save();
+}
+
+bool AfcIndex::lookup( const QString& dir, ItemList& items ) const
+{
+    QMutexLocker lock(&_mutex);
+
+    QHash<QString, Dir>::const_iterator it = _dirs.constFind(dir);
+    if ( it == _dirs.constEnd() )
+        return false;
+
+    items = it->items;
+    return true;
+}
+
+void AfcIndex::update( const QString& dir, const ItemList& items )
+{
+    Dir content;
+    content.items = items;
+    content.stamp = time(NULL);
+    content.bytes = sizeof(IndexDir) + dir.size() + 1;
+    foreach ( const Item& item, items )
+        content.bytes += itemBytes(item);
+
+    bool due;
+    {
+        QMutexLocker lock(&_mutex);
+        insert(dir, content);
+        due = time(NULL) - _lastSave > INDEX_SAVE_INTERVAL;
+    }
+
+    if ( due )
+        save();
+}
+
+void AfcIndex::updateItem( const QString& path, const KIO::UDSEntry& entry )
+{
+    const int slash = path.lastIndexOf('/');
+    const QString dir = slash > 0 ? path.left(slash) : "/";
+
+    QMutexLocker lock(&_mutex);
+
+    QHash<QString, Dir>::iterator it = _dirs.find(dir);
+    if ( it == _dirs.end() )
+        return;
+
+    Item item = fromUDSEntry(entry);
+    item.name = path.mid(slash + 1);
+
+    for (int i = 0; i < it->items.size(); i++)
+    {
+        if ( it->items.at(i).name == item.name )
+        {
+            it->items[i] = item;
+            _dirty = true;
+            return;
+        }
+    }
+}
+
+void AfcIndex::remove( const QString& path )
+{
+    const int slash = path.lastIndexOf('/');
+    const QString dir = slash > 0 ? path.left(slash) : "/";
+    const QString name = path.mid(slash + 1);
+    const QString prefix = path + '/';
+
+    QMutexLocker lock(&_mutex);
+
+    //the entry in its parent, new or removed names are found by the
+    //next listing anyway
+    QHash<QString, Dir>::iterator it = _dirs.find(dir);
+    if ( it != _dirs.end() )
+    {
+        for (int i = 0; i < it->items.size(); i++)
+        {
+            if ( it->items.at(i).name == name )
+            {
+                it->bytes -= itemBytes( it->items.at(i) );
+                _bytes -= itemBytes( it->items.at(i) );
+                it->items.removeAt(i);
+                _dirty = true;
+                break;
+            }
+        }
+    }
+
+    it = _dirs.begin();
+    while ( it != _dirs.end() )
+    {
+        if ( it.key() == path || it.key().startsWith(prefix) )
+        {
+            _bytes -= it->bytes;
+            it = _dirs.erase(it);
+            _dirty = true;
+        }
+        else
+        {
+            ++it;
+        }
+    }
+}
+
+void AfcIndex::save()
+{
+    QMutexLocker lock(&_mutex);
+
+    _lastSave = time(NULL);
+    if ( !_dirty )
+        return;
+
+    //parents sort before their children, so they already have an index
+    QStringList dirs = _dirs.keys();
+    dirs.sort();
+
+    QHash<QString, quint32> strings;
+    QByteArray pool;
+    QHash<QString, qint32> dirIndex;
+    QList<IndexDir> dirRecords;
+    QList<IndexItem> itemRecords;
+
+    foreach ( const QString& path, dirs )
+    {
+        const Dir& content = _dirs[path];
+
+        IndexDir record;
+        record.parent = -1;
+        QString name = path;
+
+        const int slash = path.lastIndexOf('/');
+        const QString parent = slash > 0 ? path.left(slash) : "/";
+        if ( path != "/" && dirIndex.contains(parent) )
+        {
+            record.parent = dirIndex.value(parent);
+            name = path.mid(slash + 1);
+        }
+
+        if ( !strings.contains(name) )
+        {
+            strings.insert(name, pool.size());
+            pool.append(name.toUtf8()).append('\0');
+        }
+        record.name = strings.value(name);
+        record.firstItem = itemRecords.size();
+        record.itemCount = content.items.size();
+        record.stamp = content.stamp;
+
+        foreach ( const Item& item, content.items )
+        {
+            if ( !strings.contains(item.name) )
+            {
+                strings.insert(item.name, pool.size());
+                pool.append(item.name.toUtf8()).append('\0');
+            }
+
+            IndexItem itemRecord;
+            itemRecord.name = strings.value(item.name);
+            itemRecord.type = item.type;
+            itemRecord.size = item.size;
+            itemRecord.mtime = item.mtime;
+            itemRecords.append(itemRecord);
+        }
+
+        dirIndex.insert(path, dirRecords.size());
+        dirRecords.append(record);
+    }
+
+    IndexHeader header;
+    header.magic = INDEX_MAGIC;
+    header.version = INDEX_VERSION;
+    header.dirCount = dirRecords.size();
+    header.itemCount = itemRecords.size();
+    header.stringBytes = pool.size();
+    header.reserved = 0;
+    header.crawled = _crawled;
+
+    //written aside and renamed over the old index, a crash leaves the
+    //previous version in place
+    KSaveFile file(_fileName);
+    if ( !file.open() )
+    {
+        kDebug(KIO_AFC) << "could not write" << _fileName;
+        return;
+    }
+
+    file.write( (const char*) &header, sizeof(header) );
+    foreach ( const IndexDir& record, dirRecords )
+        file.write( (const char*) &record, sizeof(record) );
+    foreach ( const IndexItem& record, itemRecords )
+        file.write( (const char*) &record, sizeof(record) );
+    file.write( pool );
+
+    if ( file.finalize() )
+        _dirty = false;
+}
+
+bool AfcIndex::isComplete() const
+{
+    QMutexLocker lock(&_mutex);
+    return _crawled > 0 && time(NULL) - _crawled < INDEX_CRAWL_TTL;
+}
+
+void AfcIndex::setCrawled( time_t started )
+{
+    QMutexLocker lock(&_mutex);
+    if ( _trimmed >= started )
+        return;
+    _crawled = time(NULL);
+    _dirty = true;
+}
+
+static bool pathLessThan( const AfcIndex::Match& a, const AfcIndex::Match& b )
+{
+    return a.path < b.path;
+}
+
+void AfcIndex::search( const QString& scope, const AfcSearchQuery& query, MatchList& matches ) const
+{
+    const QString prefix = scope == "/" ? scope : scope + '/';
+    const int first = matches.size();
+
+    {
+        QMutexLocker lock(&_mutex);
+
+        for ( QHash<QString, Dir>::const_iterator it = _dirs.constBegin(); it != _dirs.constEnd(); ++it )
+        {
+            if ( it.key() != scope && !it.key().startsWith(prefix) )
+                continue;
+
+            const QString dir = it.key() == "/" ? it.key() : it.key() + '/';
+            foreach ( const Item& item, it->items )
+            {
+                if ( query.matches(item) )
+                {
+                    Match match;
+                    match.path = dir + item.name;
+                    match.item = item;
+                    matches.append(match);
+                }
+            }
+        }
+    }
+
+    qSort( matches.begin() + first, matches.end(), pathLessThan );
+}
+
+AfcIndex::Item AfcIndex::fromUDSEntry( const KIO::UDSEntry& entry )
+{
+    Item item;
+    item.name = entry.stringValue(KIO::UDSEntry::UDS_NAME);
+    item.type = entry.numberValue(KIO::UDSEntry::UDS_FILE_TYPE, S_IFREG);
+    item.size = entry.numberValue(KIO::UDSEntry::UDS_SIZE, 0);
+    item.mtime = entry.numberValue(KIO::UDSEntry::UDS_MODIFICATION_TIME, 0);
+    return item;
+}
+
+KIO::UDSEntry AfcIndex::toUDSEntry( const Item& item )
+{
+    KIO::UDSEntry entry;
+    entry.insert( KIO::UDSEntry::UDS_NAME, item.name );
+    entry.insert( KIO::UDSEntry::UDS_FILE_TYPE, item.type );
+    entry.insert( KIO::UDSEntry::UDS_SIZE, item.size );
+    entry.insert( KIO::UDSEntry::UDS_MODIFICATION_TIME, item.mtime );
+
+    if ( S_ISDIR(item.type) )
+        entry.insert( KIO::UDSEntry::UDS_ACCESS, 0755 );
+    else if ( S_ISLNK(item.type) )
+        entry.insert( KIO::UDSEntry::UDS_ACCESS, 0777 );
+    else
+        entry.insert( KIO::UDSEntry::UDS_ACCESS, 0644 );
+
+    entry.insert( KIO::UDSEntry::UDS_USER, AfcProtocol::m_user );
+    entry.insert( KIO::UDSEntry::UDS_GROUP, AfcProtocol::m_group );
+    return entry;
+}
+
+void AfcIndex::load()
+{
+    QFile file(_fileName);
+    if ( !file.open(QIODevice::ReadOnly) || file.size() < (qint64) sizeof(IndexHeader) )
+        return;
+
+    const uchar* data = file.map( 0, file.size() );
+    if ( NULL == data )
+        return;
+
+    const IndexHeader* header = (const IndexHeader*) data;
+    const qint64 expected = sizeof(IndexHeader)
+                            + (qint64) header->dirCount * sizeof(IndexDir)
+                            + (qint64) header->itemCount * sizeof(IndexItem)
+                            + header->stringBytes;
+
+    if ( header->magic != INDEX_MAGIC || header->version != INDEX_VERSION || expected != file.size()
+         || ( header->stringBytes > 0 && data[file.size() - 1] != '\0' ) )
+    {
+        kDebug(KIO_AFC) << "ignoring incompatible index" << _fileName;
+        file.unmap( (uchar*) data );
+        return;
+    }
+
+    const IndexDir* dirs = (const IndexDir*) (data + sizeof(IndexHeader));
+    const IndexItem* items = (const IndexItem*) (dirs + header->dirCount);
+    const char* strings = (const char*) (items + header->itemCount);
+
+    QVector<QString> paths(header->dirCount);
+    for (quint32 i = 0; i < header->dirCount; i++)
+    {
+        const IndexDir& record = dirs[i];
+        if ( record.name >= header->stringBytes || record.firstItem + record.itemCount > header->itemCount
+             || record.parent >= (qint32) i )
+            break;
+
+        const QString name = QString::fromUtf8( strings + record.name );
+        if ( record.parent < 0 )
+            paths[i] = name;
+        else
+            paths[i] = ( paths[record.parent] == "/" ? QString() : paths[record.parent] ) + '/' + name;
+
+        Dir content;
+        content.stamp = record.stamp;
+        content.bytes = sizeof(IndexDir) + paths[i].size() + 1;
+        for (quint32 j = record.firstItem; j < record.firstItem + record.itemCount; j++)
+        {
+            if ( items[j].name >= header->stringBytes )
+                continue;
+
+            Item item;
+            item.name = QString::fromUtf8( strings + items[j].name );
+            item.type = items[j].type;
+            item.size = items[j].size;
+            item.mtime = items[j].mtime;
+            content.items.append(item);
+            content.bytes += itemBytes(item);
+        }
+        insert(paths[i], content);
+    }
+
+    _crawled = header->crawled;
+    file.unmap( (uchar*) data );
+    _dirty = false;
+
+    kDebug(KIO_AFC) << "loaded" << _dirs.size() << "directories from" << _fileName;
+}
+
+void AfcIndex::insert( const QString& dir, const Dir& content )
+{
+    QHash<QString, Dir>::iterator it = _dirs.find(dir);
+    if ( it != _dirs.end() )
+        _bytes -= it->bytes;
+
+    _dirs.insert(dir, content);
+    _bytes += content.bytes;
+    _dirty = true;
+
+    if ( _bytes > INDEX_MAX_BYTES )
+        trim();
+}
+
+void AfcIndex::trim()
+{
+    //drop the directories refreshed the longest time ago, the index then
+    //no longer holds the whole device
+    _crawled = 0;
+    _trimmed = time(NULL);
+    QMultiMap<time_t, QString> byAge;
+    for ( QHash<QString, Dir>::const_iterator it = _dirs.constBegin(); it != _dirs.constEnd(); ++it )
+        byAge.insert( it->stamp, it.key() );
+
+    QMultiMap<time_t, QString>::const_iterator oldest = byAge.constBegin();
+    while ( _bytes > INDEX_MAX_BYTES * 3 / 4 && oldest != byAge.constEnd() )
+    {
+        _bytes -= _dirs.value( oldest.value() ).bytes;
+        _dirs.remove( oldest.value() );
+        ++oldest;
+    }
+}
@@ -0,0 +1,106 @@
+/***************************************************************************
+ *   Copyright (C) 2010 by Jonathan Beck <jonabeck@gmail.com>              *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ ***************************************************************************/
+
+#ifndef AFCINDEX_H
+#define AFCINDEX_H
+
+#include <QtCore/QHash>
+#include <QtCore/QList>
+#include <QtCore/QMutex>
+#include <QtCore/QString>
+
+#include <kio/global.h>
+#include <kio/udsentry.h>
+
+#include <sys/types.h>
+#include <time.h>
+
+class AfcSearchQuery;
+
+/**
+ * Persistent index of the directories of one device, kept in the user
+ * cache between sessions so listings can be answered without stating
+ * every entry again.
+ *
+ * The file holds a header with a format version and the time of the
+ * last complete crawl, the directories (each
+ * named relative to its parent), their entries and a pool of interned
+ * UTF-8 names. It is read through a memory map and replaced atomically
+ * on save. Directories that were not refreshed for the longest time are
+ * dropped when the index grows over its size cap.
+ */
+class AfcIndex
+{
+public:
+    struct Item
+    {
+        QString name;
+        mode_t type;
+        KIO::filesize_t size;
+        time_t mtime;
+    };
+    typedef QList<Item> ItemList;
+
+    struct Match
+    {
+        QString path;
+        Item item;
+    };
+    typedef QList<Match> MatchList;
+
+    AfcIndex( const QString& id );
+    ~AfcIndex();
+
+    bool lookup( const QString& dir, ItemList& items ) const;
+    void update( const QString& dir, const ItemList& items );
+    void updateItem( const QString& path, const KIO::UDSEntry& entry );
+
+    /** Forgets path, and everything below it when it is a directory */
+    void remove( const QString& path );
+
+    void save();
+
+    /** @return true if a crawl of the whole device ended recently enough */
+    bool isComplete() const;
+    /**
+     * Records the end of a crawl of the whole device that began at started,
+     * unless directories were dropped to fit the size cap meanwhile
+     */
+    void setCrawled( time_t started );
+
+    /** Appends the items below scope matching query, sorted by path */
+    void search( const QString& scope, const AfcSearchQuery& query, MatchList& matches ) const;
+
+    static Item fromUDSEntry( const KIO::UDSEntry& entry );
+    static KIO::UDSEntry toUDSEntry( const Item& item );
+
+private:
+    struct Dir
+    {
+        ItemList items;
+        time_t stamp;
+        qint64 bytes;
+    };
+
+    void load();
+    void insert( const QString& dir, const Dir& content );
+    void trim();
+
+    QString _fileName;
+
+    mutable QMutex _mutex;
+    QHash<QString, Dir> _dirs;
+    qint64 _bytes;
+    bool _dirty;
+    time_t _lastSave;
+    time_t _crawled;
+    time_t _trimmed;
+};
+
+#endif // AFCINDEX_H
@@ -0,0 +1,237 @@
+/*
+   Copyright (C) 2010 Jonathan Beck <jonabeck@gmail.com>
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public
+   License (LGPL) as published by the Free Software Foundation;
+   either version 2 of the License, or (at your option) any later
+   version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public License
+   along with this library; see the file COPYING.LIB.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+*/
+
+#include "afcindexupdater.h"
+#include "afcindex.h"
+#include "afcclientpool.h"
+#include "afctreewalker.h"
+#include "afcdevice.h"
+
+#include <QtCore/QMutexLocker>
+#include <QtCore/QHash>
+
+#define CRAWL_WORKERS 2
+
+/**
+ * Fills the index with every directory met during a walk.
+ */
+class AfcIndexWalker : public AfcTreeWalker
+{
+public:
+    AfcIndexWalker( AfcIndexUpdater* updater, AfcIndex* index, AfcClientPool* pool, afc_client_t afc ) :
+            AfcTreeWalker(pool, afc, CRAWL_WORKERS),
+            _updater(updater),
+            _index(index)
+    {
+    }
+
+protected:
+    virtual bool visitFile( afc_client_t client, const QString& path, const KIO::UDSEntry& entry )
+    {
+        Q_UNUSED(client);
+        add(path, entry);
+        return !_updater->isStopping();
+    }
+
+    virtual bool visitDir( afc_client_t client, const QString& path, const KIO::UDSEntry& entry )
+    {
+        Q_UNUSED(client);
+        add(path, entry);
+        return !_updater->isStopping();
+    }
+
+    virtual void leaveDir( afc_client_t client, const QString& path )
+    {
+        Q_UNUSED(client);
+
+        AfcIndex::ItemList items;
+        {
+            QMutexLocker lock(&_mutex);
+            items = _pending.take(path);
+        }
+        _index->update(path, items);
+    }
+
+private:
+    void add( const QString& path, const KIO::UDSEntry& entry )
+    {
+        const int slash = path.lastIndexOf('/');
+        const QString dir = slash > 0 ? path.left(slash) : "/";
+
+        QMutexLocker lock(&_mutex);
+        _pending[dir].append( AfcIndex::fromUDSEntry(entry) );
+    }
+
+    AfcIndexUpdater* _updater;
+    AfcIndex* _index;
+
+    //entries of the directories being walked
+    QMutex _mutex;
+    QHash<QString, AfcIndex::ItemList> _pending;
+};
+
+AfcIndexUpdater::AfcIndexUpdater( AfcIndex* index, AfcClientPool* pool ) :
+        _index(index),
+        _pool(pool),
+        _crawl(false),
+        _crawling(false),
+        _crawlOk(false),
+        _stop(false)
+{
+}
+
+AfcIndexUpdater::~AfcIndexUpdater()
+{
+    {
+        QMutexLocker lock(&_mutex);
+        _stop = true;
+        _wake.wakeAll();
+        _crawlDone.wakeAll();
+    }
+    wait();
+}
+
+void AfcIndexUpdater::refresh( const QString& dir )
+{
+    QMutexLocker lock(&_mutex);
+
+    if ( !_queue.contains(dir) )
+        _queue.enqueue(dir);
+    _wake.wakeAll();
+
+    if ( !isRunning() )
+        start( QThread::LowPriority );
+}
+
+void AfcIndexUpdater::crawl()
+{
+    QMutexLocker lock(&_mutex);
+
+    //a crawl already running is recent enough
+    if ( !_crawling )
+        _crawl = true;
+    _wake.wakeAll();
+
+    if ( !isRunning() )
+        start( QThread::LowPriority );
+}
+
+bool AfcIndexUpdater::waitForCrawl()
+{
+    QMutexLocker lock(&_mutex);
+    while ( ( _crawl || _crawling ) && !_stop )
+        _crawlDone.wait(&_mutex);
+    return _crawlOk && !_stop;
+}
+
+bool AfcIndexUpdater::isStopping() const
+{
+    QMutexLocker lock(&_mutex);
+    return _stop;
+}
+
+void AfcIndexUpdater::run()
+{
+    afc_client_t client = _pool->acquire();
+    if ( NULL == client )
+    {
+        //no connection, the crawl failed rather than ended
+        QMutexLocker lock(&_mutex);
+        _crawl = false;
+        _crawlOk = false;
+        _crawlDone.wakeAll();
+        return;
+    }
+
+    while ( true )
+    {
+        QString dir;
+        bool crawl = false;
+        {
+            QMutexLocker lock(&_mutex);
+            while ( _queue.isEmpty() && !_crawl && !_stop )
+                _wake.wait(&_mutex);
+            if ( _stop )
+                break;
+
+            if ( !_queue.isEmpty() )
+            {
+                dir = _queue.dequeue();
+            }
+            else
+            {
+                crawl = true;
+                _crawl = false;
+                _crawling = true;
+            }
+        }
+
+        if ( crawl )
+        {
+            //an interrupted crawl is not complete, the next search starts
+            //another one
+            const time_t started = time(NULL);
+            AfcIndexWalker walker(this, _index, _pool, client);
+            const bool ok = AFC_E_SUCCESS == walker.walk("/");
+            if ( ok )
+                _index->setCrawled(started);
+            _index->save();
+
+            QMutexLocker lock(&_mutex);
+            _crawling = false;
+            _crawlOk = ok;
+            _crawlDone.wakeAll();
+        }
+        else
+        {
+            refreshDir(client, dir);
+        }
+    }
+
+    _pool->release(client);
+}
+
+void AfcIndexUpdater::refreshDir( afc_client_t client, const QString& dir )
+{
+    char **list = NULL;
+    if ( AFC_E_SUCCESS != afc_read_directory( client, (const char*) dir.toLocal8Bit(), &list ) )
+    {
+        _index->remove(dir);
+        return;
+    }
+
+    const QString prefix = dir.compare("/") ? dir + '/' : dir;
+    AfcIndex::ItemList items;
+    for ( char** ptr = list; NULL != *ptr; ptr++ )
+    {
+        if ( strcmp(*ptr, ".") && strcmp(*ptr, "..") && !isStopping() )
+        {
+            const QString name = QString::fromLocal8Bit(*ptr);
+            KIO::UDSEntry entry;
+            if ( AFC_E_SUCCESS == AfcDevice::fillUDSEntry( client, name, prefix + name, entry ) )
+                items.append( AfcIndex::fromUDSEntry(entry) );
+        }
+        free(*ptr);
+    }
+    free(list);
+
+    if ( !isStopping() )
+        _index->update(dir, items);
+}
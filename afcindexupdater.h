@@ -0,0 +1,65 @@
+/***************************************************************************
+ *   Copyright (C) 2010 by Jonathan Beck <jonabeck@gmail.com>              *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ ***************************************************************************/
+
+#ifndef AFCINDEXUPDATER_H
+#define AFCINDEXUPDATER_H
+
+#include <libimobiledevice/afc.h>
+
+#include <QtCore/QThread>
+#include <QtCore/QMutex>
+#include <QtCore/QWaitCondition>
+#include <QtCore/QQueue>
+#include <QtCore/QString>
+
+class AfcIndex;
+class AfcClientPool;
+
+/**
+ * Keeps the persistent index of a device up to date in the background:
+ * listings served from the index are checked again here, and a full
+ * crawl of the device fills an index that was never completed or has
+ * grown stale.
+ */
+class AfcIndexUpdater : public QThread
+{
+public:
+    AfcIndexUpdater( AfcIndex* index, AfcClientPool* pool );
+    virtual ~AfcIndexUpdater();
+
+    void refresh( const QString& dir );
+    void crawl();
+    /**
+     * Blocks until the pending crawl, if any, is over
+     * @return true if the last crawl walked the whole device
+     */
+    bool waitForCrawl();
+
+    bool isStopping() const;
+
+protected:
+    virtual void run();
+
+private:
+    void refreshDir( afc_client_t client, const QString& dir );
+
+    AfcIndex* _index;
+    AfcClientPool* _pool;
+
+    mutable QMutex _mutex;
+    QWaitCondition _wake;
+    QWaitCondition _crawlDone;
+    QQueue<QString> _queue;
+    bool _crawl;
+    bool _crawling;
+    bool _crawlOk;
+    bool _stop;
+};
+
+#endif // AFCINDEXUPDATER_H
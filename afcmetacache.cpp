@@ -0,0 +1,109 @@
+/*
+   Copyright (C) 2010 Jonathan Beck <jonabeck@gmail.com>
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public
+   License (LGPL) as published by the Free Software Foundation;
+   either version 2 of the License, or (at your option) any later
+   version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public License
+   along with this library; see the file COPYING.LIB.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+*/
+
+#include "afcmetacache.h"
+
+#include <kdebug.h>
+
+#include <QtCore/QStringList>
+
+#define KIO_AFC 7002
+
+#define CACHE_MAX_ENTRIES 8192
+#define CACHE_TTL 5
+
+AfcMetaCache::AfcMetaCache() :
+        _items(CACHE_MAX_ENTRIES),
+        _hits(0),
+        _misses(0)
+{
+}
+
+AfcMetaCache::~AfcMetaCache()
+{
+    kDebug(KIO_AFC) << "metadata cache hits:" << _hits << "misses:" << _misses;
+}
+
+bool AfcMetaCache::lookup( const QString& path, KIO::UDSEntry& entry, afc_error_t& err )
+{
+    Item* item = _items.object(path);
+
+    if ( NULL != item && time(NULL) - item->stamp > CACHE_TTL )
+    {
+        _items.remove(path);
+        item = NULL;
+    }
+
+    if ( NULL == item )
+    {
+        _misses++;
+        return false;
+    }
+
+    _hits++;
+    entry = item->entry;
+    err = item->err;
+    return true;
+}
+
+void AfcMetaCache::insert( const QString& path, const KIO::UDSEntry& entry, afc_error_t err )
+{
+    //only remember missing files, other errors may be transient
+    if ( AFC_E_SUCCESS != err && AFC_E_OBJECT_NOT_FOUND != err )
+        return;
+
+    Item* item = new Item;
+    item->entry = entry;
+    item->err = err;
+    item->stamp = time(NULL);
+    _items.insert(path, item);
+}
+
+void AfcMetaCache::invalidate( const QString& path )
+{
+    _items.remove(path);
+}
+
+void AfcMetaCache::invalidateTree( const QString& path )
+{
+    const QString prefix = path.endsWith('/') ? path : path + '/';
+
+    _items.remove(path);
+    foreach ( const QString& key, _items.keys() )
+    {
+        if ( key.startsWith(prefix) )
+            _items.remove(key);
+    }
+}
+
+void AfcMetaCache::clear()
+{
+    _items.clear();
+}
+
+quint64 AfcMetaCache::hits() const
+{
+    return _hits;
+}
+
+quint64 AfcMetaCache::misses() const
+{
+    return _misses;
+}
@@ -0,0 +1,60 @@
+/***************************************************************************
+ *   Copyright (C) 2010 by Jonathan Beck <jonabeck@gmail.com>              *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ ***************************************************************************/
+
+#ifndef AFCMETACACHE_H
+#define AFCMETACACHE_H
+
+#include <libimobiledevice/afc.h>
+
+#include <QtCore/QCache>
+#include <QtCore/QString>
+
+#include <kio/udsentry.h>
+
+#include <time.h>
+
+/**
+ * Recent stat results of one device, keyed by path. Missing files are
+ * remembered too. Entries expire after a few seconds and are dropped as
+ * soon as the slave itself changes the path.
+ */
+class AfcMetaCache
+{
+public:
+    AfcMetaCache();
+    ~AfcMetaCache();
+
+    /**
+     * @return true if a fresh result for path is known, err tells if it exists
+     */
+    bool lookup( const QString& path, KIO::UDSEntry& entry, afc_error_t& err );
+    void insert( const QString& path, const KIO::UDSEntry& entry, afc_error_t err );
+
+    void invalidate( const QString& path );
+    /** Drops path and everything below it */
+    void invalidateTree( const QString& path );
+    void clear();
+
+    quint64 hits() const;
+    quint64 misses() const;
+
+private:
+    struct Item
+    {
+        KIO::UDSEntry entry;
+        afc_error_t err;
+        time_t stamp;
+    };
+
+    QCache<QString, Item> _items;
+    quint64 _hits;
+    quint64 _misses;
+};
+
+#endif // AFCMETACACHE_H
@@ -0,0 +1,371 @@
+/*
+   Copyright (C) 2010 Jonathan Beck <jonabeck@gmail.com>
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public
+   License (LGPL) as published by the Free Software Foundation;
+   either version 2 of the License, or (at your option) any later
+   version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public License
+   along with this library; see the file COPYING.LIB.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+*/
+
+#include "afcparallel.h"
+#include "afcclientpool.h"
+
+#include <QtCore/QThread>
+#include <QtCore/QMutexLocker>
+
+//chunks kept ahead of the consumer, per connection
+#define CHUNKS_AHEAD 2
+
+class AfcRangeWorker : public QThread
+{
+public:
+    AfcRangeWorker( AfcParallelReader* reader, int index ) : _reader(reader), _writer(NULL), _index(index) {}
+    AfcRangeWorker( AfcParallelWriter* writer, int index ) : _reader(NULL), _writer(writer), _index(index) {}
+
+protected:
+    virtual void run()
+    {
+        if ( NULL != _reader )
+            _reader->work(_index);
+        else
+            _writer->work(_index);
+    }
+
+private:
+    AfcParallelReader* _reader;
+    AfcParallelWriter* _writer;
+    int _index;
+};
+
+static QList<AfcRangeChannel> openChannels( AfcClientPool* pool, const QString& path, afc_file_mode_t mode, int count )
+{
+    QList<AfcRangeChannel> channels;
+
+    for (int i = 0; i < count; i++)
+    {
+        AfcRangeChannel channel;
+        channel.client = pool->acquire();
+        channel.position = 0;
+        if ( NULL == channel.client )
+            break;
+
+        if ( AFC_E_SUCCESS != afc_file_open(channel.client, (const char*) path.toLocal8Bit(), mode, &channel.fd) )
+        {
+            pool->release(channel.client);
+            break;
+        }
+        channels.append(channel);
+    }
+    return channels;
+}
+
+static void closeChannels( AfcClientPool* pool, QList<AfcRangeChannel>& channels )
+{
+    foreach ( const AfcRangeChannel& channel, channels )
+    {
+        afc_file_close(channel.client, channel.fd);
+        pool->release(channel.client);
+    }
+    channels.clear();
+}
+
+AfcParallelReader::AfcParallelReader( AfcClientPool* pool, const QString& path, KIO::filesize_t size, uint32_t chunkSize, int nbConnections,
+                                      KIO::filesize_t offset ) :
+        _pool(pool),
+        _path(path),
+        _size(size),
+        _offset(offset),
+        _chunkSize(chunkSize),
+        _nbConnections(nbConnections),
+        _nextChunk(0),
+        _nbChunks((size - offset + chunkSize - 1) / chunkSize),
+        _abort(false),
+        _err(AFC_E_SUCCESS)
+{
+}
+
+AfcParallelReader::~AfcParallelReader()
+{
+    {
+        QMutexLocker lock(&_mutex);
+        _abort = true;
+        _space.wakeAll();
+    }
+    foreach ( AfcRangeWorker* worker, _workers )
+    {
+        worker->wait();
+        delete worker;
+    }
+    closeChannels(_pool, _channels);
+}
+
+bool AfcParallelReader::start()
+{
+    _channels = openChannels(_pool, _path, AFC_FOPEN_RDONLY, _nbConnections);
+    if ( _channels.size() < 2 )
+    {
+        closeChannels(_pool, _channels);
+        return false;
+    }
+
+    for (int i = 0; i < _channels.size(); i++)
+    {
+        AfcRangeWorker* worker = new AfcRangeWorker(this, i);
+        _workers.append(worker);
+        worker->start();
+    }
+    return true;
+}
+
+bool AfcParallelReader::next( QByteArray& data )
+{
+    QMutexLocker lock(&_mutex);
+
+    while ( _nextChunk < _nbChunks && !_chunks.contains(_nextChunk) && AFC_E_SUCCESS == _err )
+        _ready.wait(&_mutex);
+
+    if ( AFC_E_SUCCESS != _err || _nextChunk >= _nbChunks )
+        return false;
+
+    data = _chunks.take(_nextChunk);
+    _nextChunk++;
+    _space.wakeAll();
+
+    //a short file on the device ends the transfer early
+    return !data.isEmpty();
+}
+
+afc_error_t AfcParallelReader::error() const
+{
+    return _err;
+}
+
+void AfcParallelReader::work( int index )
+{
+    AfcRangeChannel& channel = _channels[index];
+    const int step = _channels.size();
+
+    for ( qint64 chunk = index; chunk < _nbChunks; chunk += step )
+    {
+        {
+            QMutexLocker lock(&_mutex);
+            while ( chunk >= _nextChunk + CHUNKS_AHEAD * step && !_abort && AFC_E_SUCCESS == _err )
+                _space.wait(&_mutex);
+            if ( _abort || AFC_E_SUCCESS != _err )
+                return;
+        }
+
+        const KIO::filesize_t offset = _offset + chunk * _chunkSize;
+        const uint32_t length = (uint32_t) qMin( _size - offset, (KIO::filesize_t) _chunkSize );
+        QByteArray data( length, Qt::Uninitialized );
+        uint32_t bytes_read = 0;
+
+        //a read may return less than asked, the chunk is read to its end
+        //unless the file itself ends
+        afc_error_t err = afc_file_seek(channel.client, channel.fd, offset, SEEK_SET);
+        while ( AFC_E_SUCCESS == err && bytes_read < length )
+        {
+            uint32_t n = 0;
+            err = afc_file_read(channel.client, channel.fd, data.data() + bytes_read, length - bytes_read, &n);
+            if ( 0 == n )
+                break;
+            bytes_read += n;
+        }
+        if ( AFC_E_END_OF_DATA == err )
+            err = AFC_E_SUCCESS;
+        data.resize(bytes_read);
+
+        //only the last chunk may come short, a gap would go unnoticed
+        if ( AFC_E_SUCCESS == err && bytes_read < length && chunk < _nbChunks - 1 )
+            err = AFC_E_NOT_ENOUGH_DATA;
+
+        QMutexLocker lock(&_mutex);
+        if ( AFC_E_SUCCESS != err )
+            _err = err;
+        else
+            _chunks.insert(chunk, data);
+        _ready.wakeAll();
+    }
+}
+
+AfcParallelWriter::AfcParallelWriter( AfcClientPool* pool, const QString& path, uint32_t chunkSize, int nbConnections ) :
+        _pool(pool),
+        _path(path),
+        _chunkSize(chunkSize),
+        _nbConnections(nbConnections),
+        _offset(0),
+        _nextChannel(0),
+        _acked(0),
+        _closed(false),
+        _abort(false),
+        _err(AFC_E_SUCCESS)
+{
+}
+
+AfcParallelWriter::~AfcParallelWriter()
+{
+    abort();
+    foreach ( AfcRangeWorker* worker, _workers )
+    {
+        worker->wait();
+        delete worker;
+    }
+    closeChannels(_pool, _channels);
+}
+
+bool AfcParallelWriter::start()
+{
+    _channels = openChannels(_pool, _path, AFC_FOPEN_RW, _nbConnections);
+    if ( _channels.size() < 2 )
+    {
+        closeChannels(_pool, _channels);
+        return false;
+    }
+
+    for (int i = 0; i < _channels.size(); i++)
+    {
+        _queues.append( QQueue<Chunk>() );
+        AfcRangeWorker* worker = new AfcRangeWorker(this, i);
+        _workers.append(worker);
+        worker->start();
+    }
+    return true;
+}
+
+bool AfcParallelWriter::push( const QByteArray& data )
+{
+    _pending.append(data);
+
+    while ( (uint32_t) _pending.size() >= _chunkSize )
+    {
+        if ( !dispatch() )
+            return false;
+    }
+    return true;
+}
+
+bool AfcParallelWriter::finish()
+{
+    bool ret = _pending.isEmpty() || dispatch();
+
+    {
+        QMutexLocker lock(&_mutex);
+        _closed = true;
+        _ready.wakeAll();
+    }
+    foreach ( AfcRangeWorker* worker, _workers )
+        worker->wait();
+
+    return ret && AFC_E_SUCCESS == _err && !_abort;
+}
+
+void AfcParallelWriter::abort()
+{
+    QMutexLocker lock(&_mutex);
+
+    _abort = true;
+    _ready.wakeAll();
+    _space.wakeAll();
+}
+
+afc_error_t AfcParallelWriter::error() const
+{
+    return _err;
+}
+
+KIO::filesize_t AfcParallelWriter::takePending( QList<QByteArray>& pending )
+{
+    abort();
+    foreach ( AfcRangeWorker* worker, _workers )
+        worker->wait();
+
+    //chunks written past the first missing one are sent again, the device
+    //only vouches for a contiguous start of the file
+    QMutexLocker lock(&_mutex);
+    pending = _unacked.values();
+    if ( !_pending.isEmpty() )
+        pending.append(_pending);
+    _unacked.clear();
+    _written.clear();
+    _pending.clear();
+    return _acked;
+}
+
+bool AfcParallelWriter::dispatch()
+{
+    Chunk chunk;
+    chunk.offset = _offset;
+    chunk.data = _pending.left(_chunkSize);
+    _pending.remove(0, chunk.data.size());
+    _offset += chunk.data.size();
+
+    const int index = _nextChannel;
+    _nextChannel = (_nextChannel + 1) % _channels.size();
+
+    QMutexLocker lock(&_mutex);
+    _unacked.insert(chunk.offset, chunk.data);
+    while ( _queues[index].size() >= CHUNKS_AHEAD && AFC_E_SUCCESS == _err && !_abort )
+        _space.wait(&_mutex);
+
+    if ( AFC_E_SUCCESS != _err || _abort )
+        return false;
+
+    _queues[index].enqueue(chunk);
+    _ready.wakeAll();
+    return true;
+}
+
+void AfcParallelWriter::work( int index )
+{
+    AfcRangeChannel& channel = _channels[index];
+
+    while ( true )
+    {
+        Chunk chunk;
+        {
+            QMutexLocker lock(&_mutex);
+            while ( _queues[index].isEmpty() && !_closed && !_abort && AFC_E_SUCCESS == _err )
+                _ready.wait(&_mutex);
+            if ( _abort || AFC_E_SUCCESS != _err || _queues[index].isEmpty() )
+                return;
+            chunk = _queues[index].head();
+        }
+
+        afc_error_t err = AFC_E_SUCCESS;
+        if ( channel.position != chunk.offset )
+            err = afc_file_seek(channel.client, channel.fd, chunk.offset, SEEK_SET);
+
+        uint32_t bytes_written = 0;
+        if ( AFC_E_SUCCESS == err )
+            err = afc_file_write(channel.client, channel.fd, chunk.data.constData(), chunk.data.size(), &bytes_written);
+        channel.position = chunk.offset + chunk.data.size();
+
+        QMutexLocker lock(&_mutex);
+        _queues[index].dequeue();
+        if ( AFC_E_SUCCESS != err )
+        {
+            _err = err;
+        }
+        else
+        {
+            _written.insert(chunk.offset);
+            while ( !_unacked.isEmpty() && _written.remove( _unacked.begin().key() ) )
+            {
+                _acked = _unacked.begin().key() + _unacked.begin().value().size();
+                _unacked.erase( _unacked.begin() );
+            }
+        }
+        _space.wakeAll();
+    }
+}
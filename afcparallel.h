@@ -0,0 +1,161 @@
+/***************************************************************************
+ *   Copyright (C) 2010 by Jonathan Beck <jonabeck@gmail.com>              *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ ***************************************************************************/
+
+#ifndef AFCPARALLEL_H
+#define AFCPARALLEL_H
+
+#include <libimobiledevice/afc.h>
+
+#include <QtCore/QMutex>
+#include <QtCore/QWaitCondition>
+#include <QtCore/QHash>
+#include <QtCore/QList>
+#include <QtCore/QMap>
+#include <QtCore/QQueue>
+#include <QtCore/QSet>
+#include <QtCore/QByteArray>
+#include <QtCore/QString>
+
+#include <kio/global.h>
+
+class AfcClientPool;
+class AfcRangeWorker;
+
+/**
+ * One file opened on its own connection of a client pool.
+ */
+struct AfcRangeChannel
+{
+    afc_client_t client;
+    uint64_t fd;
+    KIO::filesize_t position;
+};
+
+/**
+ * Downloads one file over several connections. Chunk i is read by
+ * connection i modulo the number of connections, and chunks are handed
+ * back in file order. Only a couple of chunks per connection are kept
+ * ahead of the consumer.
+ */
+class AfcParallelReader
+{
+public:
+    /** Reads path from offset to size */
+    AfcParallelReader( AfcClientPool* pool, const QString& path, KIO::filesize_t size, uint32_t chunkSize, int nbConnections,
+                       KIO::filesize_t offset = 0 );
+    ~AfcParallelReader();
+
+    /**
+     * Opens the file on the pool connections and starts reading.
+     * @return false if less than two connections could be used
+     */
+    bool start();
+
+    /**
+     * Waits for the next chunk in file order.
+     * @return false at end of file or on error
+     */
+    bool next( QByteArray& data );
+
+    afc_error_t error() const;
+
+private:
+    friend class AfcRangeWorker;
+
+    void work( int index );
+
+    AfcClientPool* _pool;
+    QString _path;
+    KIO::filesize_t _size;
+    KIO::filesize_t _offset;
+    uint32_t _chunkSize;
+    int _nbConnections;
+
+    QList<AfcRangeChannel> _channels;
+    QList<AfcRangeWorker*> _workers;
+
+    QMutex _mutex;
+    QWaitCondition _ready;
+    QWaitCondition _space;
+    QHash<qint64, QByteArray> _chunks;
+    qint64 _nextChunk;
+    qint64 _nbChunks;
+    bool _abort;
+    afc_error_t _err;
+};
+
+/**
+ * Uploads one file over several connections. Incoming data is gathered
+ * into chunks that are written, at their offset, by the connections in
+ * turn. Each connection has a short queue so the slave is held back
+ * when the device cannot keep up. Chunks are kept until everything up
+ * to their end is written, so a failed upload can go on elsewhere.
+ */
+class AfcParallelWriter
+{
+public:
+    AfcParallelWriter( AfcClientPool* pool, const QString& path, uint32_t chunkSize, int nbConnections );
+    ~AfcParallelWriter();
+
+    /**
+     * Opens the already created file on the pool connections.
+     * @return false if less than two connections could be used
+     */
+    bool start();
+
+    bool push( const QByteArray& data );
+    bool finish();
+    void abort();
+
+    afc_error_t error() const;
+
+    /**
+     * Stops the writer and hands back what the device may not have.
+     * @param pending the data following the returned offset, in order
+     * @return the offset up to which the file is known to be written
+     */
+    KIO::filesize_t takePending( QList<QByteArray>& pending );
+
+private:
+    friend class AfcRangeWorker;
+
+    struct Chunk
+    {
+        KIO::filesize_t offset;
+        QByteArray data;
+    };
+
+    bool dispatch();
+    void work( int index );
+
+    AfcClientPool* _pool;
+    QString _path;
+    uint32_t _chunkSize;
+    int _nbConnections;
+
+    QList<AfcRangeChannel> _channels;
+    QList<AfcRangeWorker*> _workers;
+
+    QByteArray _pending;
+    KIO::filesize_t _offset;
+    int _nextChannel;
+
+    QMutex _mutex;
+    QWaitCondition _ready;
+    QWaitCondition _space;
+    QList< QQueue<Chunk> > _queues;
+    QMap<KIO::filesize_t, QByteArray> _unacked;
+    QSet<KIO::filesize_t> _written;
+    KIO::filesize_t _acked;
+    bool _closed;
+    bool _abort;
+    afc_error_t _err;
+};
+
+#endif // AFCPARALLEL_H
@@ -0,0 +1,121 @@
+/*
+   Copyright (C) 2010 Jonathan Beck <jonabeck@gmail.com>
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public
+   License (LGPL) as published by the Free Software Foundation;
+   either version 2 of the License, or (at your option) any later
+   version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public License
+   along with this library; see the file COPYING.LIB.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+*/
+
+#include "afcreadcache.h"
+
+#include <string.h>
+
+#define BLOCK_SIZE (64 * 1024)
+#define MAX_BLOCKS 64
+#define MAX_WINDOW 16
+
+AfcReadCache::AfcReadCache( afc_client_t afc, uint64_t fd ) :
+        _afc(afc),
+        _fd(fd),
+        _blocks(MAX_BLOCKS),
+        _nextBlock(-1),
+        _window(1)
+{
+}
+
+afc_error_t AfcReadCache::read( KIO::filesize_t offset, char* data, uint32_t size, uint32_t& bytes_read )
+{
+    bytes_read = 0;
+
+    while ( bytes_read < size )
+    {
+        const KIO::filesize_t pos = offset + bytes_read;
+        const qint64 index = pos / BLOCK_SIZE;
+        const int inBlock = pos % BLOCK_SIZE;
+
+        QByteArray* block = _blocks.object(index);
+        if ( NULL == block )
+        {
+            afc_error_t err = fetch(index);
+            if ( AFC_E_SUCCESS != err )
+                return err;
+
+            block = _blocks.object(index);
+            if ( NULL == block )
+                break; //end of file
+        }
+
+        if ( inBlock >= block->size() )
+            break;
+
+        const uint32_t count = qMin( size - bytes_read, (uint32_t) (block->size() - inBlock) );
+        memcpy( data + bytes_read, block->constData() + inBlock, count );
+        bytes_read += count;
+
+        //a short block is only stored at the end of the file, do not ask
+        //the device for more
+        if ( block->size() < BLOCK_SIZE && inBlock + (int) count == block->size() )
+            break;
+    }
+    return AFC_E_SUCCESS;
+}
+
+void AfcReadCache::clear()
+{
+    _blocks.clear();
+    _nextBlock = -1;
+    _window = 1;
+}
+
+afc_error_t AfcReadCache::fetch( qint64 index )
+{
+    //grow the read ahead while the access pattern is sequential
+    if ( index == _nextBlock )
+        _window = qMin( _window * 2, MAX_WINDOW );
+    else
+        _window = 1;
+
+    int count = 1;
+    while ( count < _window && !_blocks.contains( index + count ) )
+        count++;
+
+    afc_error_t err = afc_file_seek( _afc, _fd, index * BLOCK_SIZE, SEEK_SET );
+    if ( AFC_E_SUCCESS != err )
+        return err;
+
+    //a read may return less than asked, the window is filled until the
+    //device has nothing more. Only then may the last block be short
+    QByteArray buffer( count * BLOCK_SIZE, Qt::Uninitialized );
+    uint32_t bytes_read = 0;
+    while ( bytes_read < (uint32_t) buffer.size() )
+    {
+        uint32_t n = 0;
+        err = afc_file_read( _afc, _fd, buffer.data() + bytes_read, buffer.size() - bytes_read, &n );
+        if ( AFC_E_SUCCESS != err && AFC_E_END_OF_DATA != err )
+            return err;
+        if ( 0 == n )
+            break;
+        bytes_read += n;
+    }
+
+    for ( uint32_t start = 0; start < bytes_read; start += BLOCK_SIZE )
+    {
+        const int length = qMin( bytes_read - start, (uint32_t) BLOCK_SIZE );
+        _blocks.insert( index++, new QByteArray( buffer.constData() + start, length ) );
+    }
+    _nextBlock = index;
+
+    return AFC_E_SUCCESS;
+}
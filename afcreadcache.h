@@ -0,0 +1,46 @@
+/***************************************************************************
+ *   Copyright (C) 2010 by Jonathan Beck <jonabeck@gmail.com>              *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ ***************************************************************************/
+
+#ifndef AFCREADCACHE_H
+#define AFCREADCACHE_H
+
+#include <libimobiledevice/afc.h>
+
+#include <QtCore/QCache>
+#include <QtCore/QByteArray>
+
+#include <kio/global.h>
+
+/**
+ * Block cache in front of an opened file, used for the random access
+ * read() and seek() calls. Blocks are kept in LRU order and misses fetch
+ * several blocks at once, the window growing while the reads stay
+ * sequential and dropping back on a seek.
+ */
+class AfcReadCache
+{
+public:
+    AfcReadCache( afc_client_t afc, uint64_t fd );
+
+    afc_error_t read( KIO::filesize_t offset, char* data, uint32_t size, uint32_t& bytes_read );
+
+    void clear();
+
+private:
+    afc_error_t fetch( qint64 block );
+
+    afc_client_t _afc;
+    uint64_t _fd;
+
+    QCache<qint64, QByteArray> _blocks;
+    qint64 _nextBlock;
+    int _window;
+};
+
+#endif // AFCREADCACHE_H
@@ -0,0 +1,80 @@
+/*
+   Copyright (C) 2010 Jonathan Beck <jonabeck@gmail.com>
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public
+   License (LGPL) as published by the Free Software Foundation;
+   either version 2 of the License, or (at your option) any later
+   version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public License
+   along with this library; see the file COPYING.LIB.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+*/
+
+#include "afcsearch.h"
+
+#include <sys/stat.h>
+
+AfcSearchQuery::AfcSearchQuery( const KUrl& url ) :
+        _text( url.queryItem("search") ),
+        _isGlob(false),
+        _type(0),
+        _minSize(-1),
+        _maxSize(-1),
+        _after(0),
+        _before(0)
+{
+    if ( _text.contains('*') || _text.contains('?') || _text.contains('[') )
+    {
+        _glob = QRegExp( _text, Qt::CaseInsensitive, QRegExp::Wildcard );
+        _isGlob = true;
+    }
+
+    const QString type = url.queryItem("type");
+    if ( type == "file" )
+        _type = S_IFREG;
+    else if ( type == "dir" )
+        _type = S_IFDIR;
+    else if ( type == "link" )
+        _type = S_IFLNK;
+
+    bool ok;
+    qint64 value = url.queryItem("minsize").toLongLong(&ok);
+    if ( ok )
+        _minSize = value;
+    value = url.queryItem("maxsize").toLongLong(&ok);
+    if ( ok )
+        _maxSize = value;
+    value = url.queryItem("after").toLongLong(&ok);
+    if ( ok )
+        _after = value;
+    value = url.queryItem("before").toLongLong(&ok);
+    if ( ok )
+        _before = value;
+}
+
+bool AfcSearchQuery::matches( const AfcIndex::Item& item ) const
+{
+    //cheap filters first, names are compared last
+    if ( 0 != _type && (item.type & S_IFMT) != _type )
+        return false;
+    if ( _minSize >= 0 && item.size < (KIO::filesize_t) _minSize )
+        return false;
+    if ( _maxSize >= 0 && item.size > (KIO::filesize_t) _maxSize )
+        return false;
+    if ( 0 != _after && item.mtime < _after )
+        return false;
+    if ( 0 != _before && item.mtime > _before )
+        return false;
+
+    if ( _isGlob )
+        return _glob.exactMatch(item.name);
+    return _text.isEmpty() || item.name.contains(_text, Qt::CaseInsensitive);
+}
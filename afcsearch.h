@@ -0,0 +1,47 @@
+/***************************************************************************
+ *   Copyright (C) 2010 by Jonathan Beck <jonabeck@gmail.com>              *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ ***************************************************************************/
+
+#ifndef AFCSEARCH_H
+#define AFCSEARCH_H
+
+#include <QtCore/QRegExp>
+#include <QtCore/QString>
+
+#include <kurl.h>
+
+#include "afcindex.h"
+
+/**
+ * Name search over the index of a device, described by the query items
+ * of an url:
+ *  - search: glob (when it holds *, ? or [) or substring of the name,
+ *    case insensitive
+ *  - type: file, dir or link
+ *  - minsize, maxsize: in bytes
+ *  - after, before: modification time, in seconds since the epoch
+ */
+class AfcSearchQuery
+{
+public:
+    explicit AfcSearchQuery( const KUrl& url );
+
+    bool matches( const AfcIndex::Item& item ) const;
+
+private:
+    QString _text;
+    QRegExp _glob;
+    bool _isGlob;
+    mode_t _type;
+    qint64 _minSize;
+    qint64 _maxSize;
+    time_t _after;
+    time_t _before;
+};
+
+#endif // AFCSEARCH_H
@@ -0,0 +1,157 @@
+/*
+   Copyright (C) 2010 Jonathan Beck <jonabeck@gmail.com>
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public
+   License (LGPL) as published by the Free Software Foundation;
+   either version 2 of the License, or (at your option) any later
+   version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public License
+   along with this library; see the file COPYING.LIB.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+*/
+
+#include "afcsync.h"
+
+#include <QtCore/QCryptographicHash>
+#include <QtCore/QDirIterator>
+#include <QtCore/QFile>
+#include <QtCore/QMutexLocker>
+
+#include <kde_file.h>
+
+#include <sys/stat.h>
+
+static AfcIndex::Item toItem( mode_t type, KIO::filesize_t size, time_t mtime )
+{
+    AfcIndex::Item item;
+    item.type = type;
+    item.size = size;
+    item.mtime = mtime;
+    return item;
+}
+
+AfcRemoteScanner::AfcRemoteScanner( AfcClientPool* pool, afc_client_t afc, int nbWorkers ) :
+        AfcTreeWalker(pool, afc, nbWorkers),
+        _skip(0)
+{
+}
+
+afc_error_t AfcRemoteScanner::scan( const QString& root )
+{
+    _skip = root == "/" ? 1 : root.size() + 1;
+    return walk(root);
+}
+
+const AfcSyncTree& AfcRemoteScanner::tree() const
+{
+    return _tree;
+}
+
+bool AfcRemoteScanner::visitFile( afc_client_t client, const QString& path, const KIO::UDSEntry& entry )
+{
+    Q_UNUSED(client);
+    add(path, entry);
+    return true;
+}
+
+bool AfcRemoteScanner::visitDir( afc_client_t client, const QString& path, const KIO::UDSEntry& entry )
+{
+    Q_UNUSED(client);
+    add(path, entry);
+    return true;
+}
+
+void AfcRemoteScanner::add( const QString& path, const KIO::UDSEntry& entry )
+{
+    QMutexLocker lock(&_mutex);
+    _tree.insert( path.mid(_skip), AfcIndex::fromUDSEntry(entry) );
+}
+
+AfcLocalScanner::AfcLocalScanner( const QString& root ) :
+        _root(root),
+        _valid(false)
+{
+}
+
+bool AfcLocalScanner::isValid() const
+{
+    return _valid;
+}
+
+const AfcSyncTree& AfcLocalScanner::tree() const
+{
+    return _tree;
+}
+
+void AfcLocalScanner::run()
+{
+    KDE_struct_stat buff;
+    if ( KDE_stat( QFile::encodeName(_root), &buff ) != 0 || !S_ISDIR( buff.st_mode ) )
+        return;
+    _valid = true;
+
+    const int skip = _root.endsWith('/') ? _root.size() : _root.size() + 1;
+    QDirIterator it( _root, QDir::AllEntries | QDir::NoDotAndDotDot | QDir::Hidden | QDir::System,
+                     QDirIterator::Subdirectories );
+    while ( it.hasNext() )
+    {
+        const QString path = it.next();
+        if ( KDE_lstat( QFile::encodeName(path), &buff ) != 0 )
+            continue;
+        if ( !S_ISREG( buff.st_mode ) && !S_ISDIR( buff.st_mode ) )
+            continue;
+
+        _tree.insert( path.mid(skip), toItem( buff.st_mode & S_IFMT, buff.st_size, buff.st_mtime ) );
+    }
+}
+
+QByteArray afcLocalDigest( const QString& localPath )
+{
+    QFile file(localPath);
+    if ( !file.open(QIODevice::ReadOnly) )
+        return QByteArray();
+
+    QCryptographicHash hash( QCryptographicHash::Md5 );
+    while ( !file.atEnd() )
+    {
+        const QByteArray data = file.read( 1024 * 1024 );
+        if ( data.isEmpty() )
+            return QByteArray();
+        hash.addData(data);
+    }
+    return hash.result();
+}
+
+QByteArray afcRemoteDigest( afc_client_t afc, const QString& path, uint32_t chunkSize )
+{
+    uint64_t fd = 0;
+    if ( AFC_E_SUCCESS != afc_file_open( afc, (const char*) path.toLocal8Bit(), AFC_FOPEN_RDONLY, &fd ) )
+        return QByteArray();
+
+    QCryptographicHash hash( QCryptographicHash::Md5 );
+    QByteArray buffer( chunkSize, Qt::Uninitialized );
+    bool ok = true;
+    while ( true )
+    {
+        uint32_t bytes_read = 0;
+        if ( AFC_E_SUCCESS != afc_file_read( afc, fd, buffer.data(), buffer.size(), &bytes_read ) )
+        {
+            ok = false;
+            break;
+        }
+        if ( 0 == bytes_read )
+            break;
+        hash.addData( buffer.constData(), bytes_read );
+    }
+    afc_file_close( afc, fd );
+
+    return ok ? hash.result() : QByteArray();
+}
@@ -0,0 +1,75 @@
+/***************************************************************************
+ *   Copyright (C) 2010 by Jonathan Beck <jonabeck@gmail.com>              *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ ***************************************************************************/
+
+#ifndef AFCSYNC_H
+#define AFCSYNC_H
+
+#include <libimobiledevice/afc.h>
+
+#include <QtCore/QThread>
+#include <QtCore/QMutex>
+#include <QtCore/QHash>
+#include <QtCore/QString>
+
+#include "afctreewalker.h"
+#include "afcindex.h"
+
+/** Entries of a tree keyed by their path relative to its root */
+typedef QHash<QString, AfcIndex::Item> AfcSyncTree;
+
+/**
+ * Collects a tree of the device with several connections.
+ */
+class AfcRemoteScanner : public AfcTreeWalker
+{
+public:
+    AfcRemoteScanner( AfcClientPool* pool, afc_client_t afc, int nbWorkers );
+
+    afc_error_t scan( const QString& root );
+    const AfcSyncTree& tree() const;
+
+protected:
+    virtual bool visitFile( afc_client_t client, const QString& path, const KIO::UDSEntry& entry );
+    virtual bool visitDir( afc_client_t client, const QString& path, const KIO::UDSEntry& entry );
+
+private:
+    void add( const QString& path, const KIO::UDSEntry& entry );
+
+    int _skip;
+    QMutex _mutex;
+    AfcSyncTree _tree;
+};
+
+/**
+ * Collects a local tree on its own thread, while the device is walked.
+ * Symbolic links are skipped.
+ */
+class AfcLocalScanner : public QThread
+{
+public:
+    AfcLocalScanner( const QString& root );
+
+    /** @return false if the root is not a readable folder */
+    bool isValid() const;
+    const AfcSyncTree& tree() const;
+
+protected:
+    virtual void run();
+
+private:
+    QString _root;
+    bool _valid;
+    AfcSyncTree _tree;
+};
+
+/** MD5 digests of file contents, empty on error */
+QByteArray afcLocalDigest( const QString& localPath );
+QByteArray afcRemoteDigest( afc_client_t afc, const QString& path, uint32_t chunkSize );
+
+#endif // AFCSYNC_H
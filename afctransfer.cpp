@@ -0,0 +1,239 @@
+/*
+   Copyright (C) 2010 Jonathan Beck <jonabeck@gmail.com>
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public
+   License (LGPL) as published by the Free Software Foundation;
+   either version 2 of the License, or (at your option) any later
+   version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public License
+   along with this library; see the file COPYING.LIB.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+*/
+
+#include "afctransfer.h"
+
+#include <QtCore/QMutexLocker>
+#include <QtCore/QTime>
+
+AfcReader::AfcReader( afc_client_t afc, uint64_t fd, KIO::filesize_t size, uint32_t chunkSize, int nbBuffers ) :
+        _afc(afc),
+        _fd(fd),
+        _size(size),
+        _ring(nbBuffers),
+        _filled(nbBuffers, 0),
+        _head(0),
+        _tail(0),
+        _count(0),
+        _done(false),
+        _abort(false),
+        _err(AFC_E_SUCCESS)
+{
+    for (int i = 0; i < _ring.size(); i++)
+        _ring[i].resize(chunkSize);
+}
+
+AfcReader::~AfcReader()
+{
+    abort();
+    wait();
+}
+
+bool AfcReader::next( QByteArray& data )
+{
+    QMutexLocker lock(&_mutex);
+
+    while ( 0 == _count && !_done )
+        _notEmpty.wait(&_mutex);
+
+    if ( 0 == _count )
+        return false;
+
+    data = QByteArray::fromRawData( _ring[_head].constData(), _filled[_head] );
+    return true;
+}
+
+void AfcReader::release()
+{
+    QMutexLocker lock(&_mutex);
+
+    Q_ASSERT( _count > 0 );
+    _head = (_head + 1) % _ring.size();
+    _count--;
+    _notFull.wakeOne();
+}
+
+void AfcReader::abort()
+{
+    QMutexLocker lock(&_mutex);
+
+    _abort = true;
+    _notFull.wakeAll();
+}
+
+afc_error_t AfcReader::error() const
+{
+    return _err;
+}
+
+void AfcReader::run()
+{
+    while ( _size > 0 )
+    {
+        int slot;
+        {
+            QMutexLocker lock(&_mutex);
+            while ( _count == _ring.size() && !_abort )
+                _notFull.wait(&_mutex);
+            if ( _abort )
+                break;
+            slot = _tail;
+        }
+
+        //the slot is not visible to the consumer until it is counted,
+        //so the device can be read without holding the lock
+        QByteArray& buffer = _ring[slot];
+        const uint32_t toRead = (uint32_t) qMin( _size, (KIO::filesize_t) buffer.size() );
+        uint32_t bytes_read = 0;
+        afc_error_t err = afc_file_read(_afc, _fd, buffer.data(), toRead, &bytes_read);
+
+        if ( 0 == bytes_read )
+        {
+            if ( AFC_E_SUCCESS != err && AFC_E_END_OF_DATA != err )
+                _err = err;
+            break;
+        }
+
+        QMutexLocker lock(&_mutex);
+        _filled[slot] = bytes_read;
+        _tail = (_tail + 1) % _ring.size();
+        _count++;
+        _size -= bytes_read;
+        _notEmpty.wakeOne();
+    }
+
+    QMutexLocker lock(&_mutex);
+    _done = true;
+    _notEmpty.wakeAll();
+}
+
+AfcWriter::AfcWriter( afc_client_t afc, uint64_t fd, int maxQueued ) :
+        _afc(afc),
+        _fd(fd),
+        _maxQueued(maxQueued),
+        _written(0),
+        _closed(false),
+        _abort(false),
+        _err(AFC_E_SUCCESS)
+{
+}
+
+AfcWriter::~AfcWriter()
+{
+    abort();
+    wait();
+}
+
+bool AfcWriter::push( const QByteArray& data, int timeout )
+{
+    QMutexLocker lock(&_mutex);
+
+    QTime waited;
+    waited.start();
+    while ( _queue.size() >= _maxQueued && AFC_E_SUCCESS == _err && !_abort )
+    {
+        if ( timeout < 0 )
+            _notFull.wait(&_mutex);
+        else if ( waited.elapsed() >= timeout || !_notFull.wait(&_mutex, timeout - waited.elapsed()) )
+            break;
+    }
+
+    if ( _abort || ( AFC_E_SUCCESS == _err && _queue.size() >= _maxQueued ) )
+        return false;
+
+    _queue.enqueue(data);
+    if ( AFC_E_SUCCESS != _err )
+        return false;
+    _notEmpty.wakeOne();
+    return true;
+}
+
+bool AfcWriter::finish()
+{
+    {
+        QMutexLocker lock(&_mutex);
+        _closed = true;
+        _notEmpty.wakeAll();
+    }
+    wait();
+
+    return AFC_E_SUCCESS == _err && !_abort;
+}
+
+void AfcWriter::abort()
+{
+    QMutexLocker lock(&_mutex);
+
+    _abort = true;
+    _notEmpty.wakeAll();
+    _notFull.wakeAll();
+}
+
+afc_error_t AfcWriter::error() const
+{
+    return _err;
+}
+
+KIO::filesize_t AfcWriter::written() const
+{
+    QMutexLocker lock(&_mutex);
+    return _written;
+}
+
+QList<QByteArray> AfcWriter::takePending()
+{
+    wait();
+
+    QMutexLocker lock(&_mutex);
+    QList<QByteArray> pending = _queue;
+    _queue.clear();
+    return pending;
+}
+
+void AfcWriter::run()
+{
+    while ( true )
+    {
+        QByteArray data;
+        {
+            QMutexLocker lock(&_mutex);
+            while ( _queue.isEmpty() && !_closed && !_abort )
+                _notEmpty.wait(&_mutex);
+            if ( _abort || _queue.isEmpty() )
+                break;
+            data = _queue.dequeue();
+        }
+
+        uint32_t bytes_written = 0;
+        afc_error_t err = afc_file_write(_afc, _fd, data.constData(), data.size(), &bytes_written);
+
+        QMutexLocker lock(&_mutex);
+        if ( AFC_E_SUCCESS != err )
+        {
+            //kept, the transfer may go on over a new connection
+            _queue.prepend(data);
+            _err = err;
+            _notFull.wakeAll();
+            break;
+        }
+        _written += bytes_written;
+        _notFull.wakeOne();
+    }
+}
@@ -0,0 +1,128 @@
+/***************************************************************************
+ *   Copyright (C) 2010 by Jonathan Beck <jonabeck@gmail.com>              *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ ***************************************************************************/
+
+#ifndef AFCTRANSFER_H
+#define AFCTRANSFER_H
+
+#include <libimobiledevice/afc.h>
+
+#include <QtCore/QThread>
+#include <QtCore/QMutex>
+#include <QtCore/QWaitCondition>
+#include <QtCore/QVector>
+#include <QtCore/QByteArray>
+#include <QtCore/QQueue>
+
+#include <kio/global.h>
+
+/**
+ * Reads a file from the device on its own thread into a small ring of
+ * preallocated buffers, so the USB link keeps working while the slave
+ * hands the previous chunk over to the application.
+ */
+class AfcReader : public QThread
+{
+public:
+    AfcReader( afc_client_t afc, uint64_t fd, KIO::filesize_t size, uint32_t chunkSize, int nbBuffers = 4 );
+    virtual ~AfcReader();
+
+    /**
+     * Waits for the next chunk. The returned array points into the ring and
+     * stays valid until release() is called.
+     * @return false once all data has been consumed or on error
+     */
+    bool next( QByteArray& data );
+    void release();
+
+    void abort();
+
+    afc_error_t error() const;
+
+protected:
+    virtual void run();
+
+private:
+    afc_client_t _afc;
+    uint64_t _fd;
+    KIO::filesize_t _size;
+
+    QMutex _mutex;
+    QWaitCondition _notEmpty;
+    QWaitCondition _notFull;
+
+    QVector<QByteArray> _ring;
+    QVector<uint32_t> _filled;
+    int _head;
+    int _tail;
+    int _count;
+
+    bool _done;
+    bool _abort;
+    afc_error_t _err;
+};
+
+/**
+ * Writes a file to the device on its own thread from a bounded queue, so
+ * the slave can request the next chunk from the job while the device is
+ * still acknowledging the previous one.
+ */
+class AfcWriter : public QThread
+{
+public:
+    AfcWriter( afc_client_t afc, uint64_t fd, int maxQueued = 4 );
+    virtual ~AfcWriter();
+
+    /**
+     * Queues data for writing, blocking while the queue is full.
+     * @param timeout longest wait in ms for room in the queue, -1 waits
+     * as long as it takes
+     * @return false if the writer failed, was aborted or timed out, in
+     * which case error() is still AFC_E_SUCCESS. Data pushed after a
+     * write error is kept for takePending()
+     */
+    bool push( const QByteArray& data, int timeout = -1 );
+
+    /**
+     * Waits until every queued chunk has reached the device.
+     * @return false if a write failed
+     */
+    bool finish();
+
+    void abort();
+
+    afc_error_t error() const;
+    KIO::filesize_t written() const;
+
+    /**
+     * Once the writer failed, the chunks that did not reach the device,
+     * in order, starting with the one being written.
+     */
+    QList<QByteArray> takePending();
+
+protected:
+    virtual void run();
+
+private:
+    afc_client_t _afc;
+    uint64_t _fd;
+    int _maxQueued;
+
+    mutable QMutex _mutex;
+    QWaitCondition _notEmpty;
+    QWaitCondition _notFull;
+
+    QQueue<QByteArray> _queue;
+    KIO::filesize_t _written;
+
+    bool _closed;
+    bool _abort;
+    afc_error_t _err;
+};
+
+#endif // AFCTRANSFER_H
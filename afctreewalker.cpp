@@ -0,0 +1,347 @@
+/*
+   Copyright (C) 2010 Jonathan Beck <jonabeck@gmail.com>
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public
+   License (LGPL) as published by the Free Software Foundation;
+   either version 2 of the License, or (at your option) any later
+   version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public License
+   along with this library; see the file COPYING.LIB.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+*/
+
+#include "afctreewalker.h"
+#include "afcclientpool.h"
+#include "afcdevice.h"
+
+#include <QtCore/QThread>
+#include <QtCore/QMutexLocker>
+
+#include <kdebug.h>
+#include <klocale.h>
+
+#include <sys/stat.h>
+
+#define KIO_AFC 7002
+
+#define PROGRESS_INTERVAL 500
+
+class AfcWalkWorker : public QThread
+{
+public:
+    AfcWalkWorker( AfcTreeWalker* walker ) : _walker(walker) {}
+
+protected:
+    virtual void run()
+    {
+        afc_client_t client = _walker->_pool->acquire();
+        if ( NULL != client )
+            _walker->work(client);
+        _walker->_pool->release(client);
+        _walker->done();
+    }
+
+private:
+    AfcTreeWalker* _walker;
+};
+
+AfcTreeWalker::AfcTreeWalker( AfcClientPool* pool, afc_client_t afc, int nbWorkers ) :
+        _pool(pool),
+        _afc(afc),
+        _nbWorkers(nbWorkers),
+        _busy(0),
+        _running(0),
+        _skipped(0),
+        _err(AFC_E_SUCCESS)
+{
+}
+
+AfcTreeWalker::~AfcTreeWalker()
+{
+}
+
+afc_error_t AfcTreeWalker::walk( const QString& root )
+{
+    _dirs.push(root);
+
+    QList<AfcWalkWorker*> workers;
+    {
+        QMutexLocker lock(&_mutex);
+        for (int i = 0; i < _nbWorkers; i++)
+        {
+            AfcWalkWorker* worker = new AfcWalkWorker(this);
+            workers.append(worker);
+            _running++;
+            worker->start();
+        }
+    }
+
+    {
+        QMutexLocker lock(&_mutex);
+        while ( _running > 0 )
+        {
+            _changed.wait(&_mutex, PROGRESS_INTERVAL);
+            lock.unlock();
+            progress();
+            lock.relock();
+        }
+    }
+
+    foreach ( AfcWalkWorker* worker, workers )
+    {
+        worker->wait();
+        delete worker;
+    }
+
+    //whatever is left when no worker could connect is done on our connection
+    if ( AFC_E_SUCCESS == _err && !_dirs.isEmpty() )
+        work(_afc);
+
+    progress();
+    return _err;
+}
+
+quint64 AfcTreeWalker::skipped() const
+{
+    QMutexLocker lock(&_mutex);
+    return _skipped;
+}
+
+bool AfcTreeWalker::visitDir( afc_client_t client, const QString& path, const KIO::UDSEntry& entry )
+{
+    Q_UNUSED(client);
+    Q_UNUSED(path);
+    Q_UNUSED(entry);
+    return true;
+}
+
+void AfcTreeWalker::leaveDir( afc_client_t client, const QString& path )
+{
+    Q_UNUSED(client);
+    Q_UNUSED(path);
+}
+
+void AfcTreeWalker::progress()
+{
+}
+
+void AfcTreeWalker::fail( afc_error_t err )
+{
+    QMutexLocker lock(&_mutex);
+    if ( AFC_E_SUCCESS == _err )
+        _err = err;
+    _changed.wakeAll();
+}
+
+bool AfcTreeWalker::skip( afc_error_t err, const QString& path )
+{
+    if ( AfcDevice::isConnectionLost(err) )
+    {
+        fail(err);
+        return false;
+    }
+
+    kDebug(KIO_AFC) << "skipping" << path << err;
+    QMutexLocker lock(&_mutex);
+    _skipped++;
+    return true;
+}
+
+void AfcTreeWalker::work( afc_client_t client )
+{
+    QString dir;
+    while ( take(dir) )
+    {
+        char **list = NULL;
+        afc_error_t err = afc_read_directory( client, (const char*) dir.toLocal8Bit(), &list );
+
+        if ( AFC_E_SUCCESS != err )
+        {
+            //a directory may vanish or be locked while we walk
+            if ( AFC_E_OBJECT_NOT_FOUND != err )
+                skip(err, dir);
+        }
+        else
+        {
+            const QString prefix = dir.compare("/") ? dir + '/' : dir;
+            for ( char** ptr = list; NULL != *ptr; ptr++ )
+            {
+                if ( AFC_E_SUCCESS != _err || !strcmp(*ptr, ".") || !strcmp(*ptr, "..") )
+                    continue;
+
+                const QString name = QString::fromLocal8Bit(*ptr);
+                const QString path = prefix + name;
+                KIO::UDSEntry entry;
+                err = AfcDevice::fillUDSEntry( client, name, path, entry );
+
+                if ( AFC_E_OBJECT_NOT_FOUND == err )
+                    continue; //gone in the meantime
+                if ( AFC_E_SUCCESS != err )
+                {
+                    skip(err, path);
+                }
+                else if ( S_ISDIR( entry.numberValue(KIO::UDSEntry::UDS_FILE_TYPE) ) )
+                {
+                    if ( visitDir( client, path, entry ) )
+                    {
+                        QMutexLocker lock(&_mutex);
+                        _dirs.push(path);
+                        _changed.wakeOne();
+                    }
+                    else
+                    {
+                        fail(AFC_E_OP_INTERRUPTED);
+                    }
+                }
+                else if ( !visitFile( client, path, entry ) )
+                {
+                    fail(AFC_E_OP_INTERRUPTED);
+                }
+            }
+        }
+
+        if ( NULL != list )
+        {
+            for ( char** ptr = list; NULL != *ptr; ptr++ )
+                free(*ptr);
+            free(list);
+            leaveDir( client, dir );
+        }
+
+        QMutexLocker lock(&_mutex);
+        _busy--;
+        _changed.wakeAll();
+    }
+}
+
+bool AfcTreeWalker::take( QString& dir )
+{
+    QMutexLocker lock(&_mutex);
+
+    //an empty stack only means the end if nobody can add to it anymore
+    while ( _dirs.isEmpty() && _busy > 0 && AFC_E_SUCCESS == _err )
+        _changed.wait(&_mutex);
+
+    if ( _dirs.isEmpty() || AFC_E_SUCCESS != _err )
+        return false;
+
+    dir = _dirs.pop();
+    _busy++;
+    return true;
+}
+
+void AfcTreeWalker::done()
+{
+    QMutexLocker lock(&_mutex);
+    _running--;
+    _changed.wakeAll();
+}
+
+AfcTreeRemover::AfcTreeRemover( AfcClientPool* pool, afc_client_t afc, int nbWorkers ) :
+        AfcTreeWalker(pool, afc, nbWorkers),
+        _afc(afc)
+{
+}
+
+afc_error_t AfcTreeRemover::remove( const QString& root )
+{
+    afc_error_t err = walk(root);
+    if ( AFC_E_SUCCESS != err )
+        return err;
+
+    //children were found after their parent, so going backwards removes
+    //the deepest directories first
+    _dirs.prepend(root);
+    for (int i = _dirs.size() - 1; i >= 0 && AFC_E_SUCCESS == err; i--)
+    {
+        err = afc_remove_path( _afc, (const char*) _dirs.at(i).toLocal8Bit() );
+    }
+    return err;
+}
+
+bool AfcTreeRemover::visitFile( afc_client_t client, const QString& path, const KIO::UDSEntry& entry )
+{
+    Q_UNUSED(entry);
+
+    afc_error_t err = afc_remove_path( client, (const char*) path.toLocal8Bit() );
+    if ( AFC_E_SUCCESS != err && AFC_E_OBJECT_NOT_FOUND != err )
+        fail(err);
+    return true;
+}
+
+bool AfcTreeRemover::visitDir( afc_client_t client, const QString& path, const KIO::UDSEntry& entry )
+{
+    Q_UNUSED(client);
+    Q_UNUSED(entry);
+
+    QMutexLocker lock(&_dirsMutex);
+    _dirs.append(path);
+    return true;
+}
+
+AfcSizeWalker::AfcSizeWalker( AfcClientPool* pool, afc_client_t afc, int nbWorkers, KIO::SlaveBase* slave ) :
+        AfcTreeWalker(pool, afc, nbWorkers),
+        _slave(slave),
+        _size(0),
+        _files(0),
+        _dirs(0)
+{
+}
+
+KIO::filesize_t AfcSizeWalker::totalSize() const
+{
+    QMutexLocker lock(&_totalsMutex);
+    return _size;
+}
+
+quint64 AfcSizeWalker::files() const
+{
+    QMutexLocker lock(&_totalsMutex);
+    return _files;
+}
+
+quint64 AfcSizeWalker::directories() const
+{
+    QMutexLocker lock(&_totalsMutex);
+    return _dirs;
+}
+
+bool AfcSizeWalker::visitFile( afc_client_t client, const QString& path, const KIO::UDSEntry& entry )
+{
+    Q_UNUSED(client);
+    Q_UNUSED(path);
+
+    QMutexLocker lock(&_totalsMutex);
+    _size += entry.numberValue(KIO::UDSEntry::UDS_SIZE, 0);
+    _files++;
+    return true;
+}
+
+bool AfcSizeWalker::visitDir( afc_client_t client, const QString& path, const KIO::UDSEntry& entry )
+{
+    Q_UNUSED(client);
+    Q_UNUSED(path);
+    Q_UNUSED(entry);
+
+    QMutexLocker lock(&_totalsMutex);
+    _dirs++;
+    return true;
+}
+
+void AfcSizeWalker::progress()
+{
+    QMutexLocker lock(&_totalsMutex);
+
+    _slave->processedSize( _size );
+    _slave->infoMessage( i18np( "%1 file", "%1 files", _files ) + ", " +
+                         i18np( "%1 folder", "%1 folders", _dirs ) + ", " +
+                         KIO::convertSize( _size ) );
+}
@@ -0,0 +1,144 @@
+/***************************************************************************
+ *   Copyright (C) 2010 by Jonathan Beck <jonabeck@gmail.com>              *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ ***************************************************************************/
+
+#ifndef AFCTREEWALKER_H
+#define AFCTREEWALKER_H
+
+#include <libimobiledevice/afc.h>
+
+#include <QtCore/QMutex>
+#include <QtCore/QWaitCondition>
+#include <QtCore/QStack>
+#include <QtCore/QStringList>
+
+#include <kio/udsentry.h>
+#include <kio/slavebase.h>
+
+class AfcClientPool;
+class AfcWalkWorker;
+
+/**
+ * Walks a directory tree of the device with several connections. Idle
+ * connections take the next pending directory from a shared stack, so
+ * the walk goes depth first and the pending list stays small. Symbolic
+ * links are reported but never followed. Entries that cannot be read are
+ * skipped and counted, only a lost connection ends the walk.
+ */
+class AfcTreeWalker
+{
+public:
+    AfcTreeWalker( AfcClientPool* pool, afc_client_t afc, int nbWorkers );
+    virtual ~AfcTreeWalker();
+
+    /**
+     * Walks everything below root and waits for the end of the walk.
+     * @return the first error met, AFC_E_SUCCESS otherwise
+     */
+    afc_error_t walk( const QString& root );
+
+    /**
+     * @return the number of directories and entries that could not be read
+     */
+    quint64 skipped() const;
+
+protected:
+    /**
+     * Called on a worker thread for each entry that is not a directory.
+     * @return false to stop the walk
+     */
+    virtual bool visitFile( afc_client_t client, const QString& path, const KIO::UDSEntry& entry ) = 0;
+
+    /**
+     * Called on a worker thread for each directory, before its content.
+     * @return false to stop the walk
+     */
+    virtual bool visitDir( afc_client_t client, const QString& path, const KIO::UDSEntry& entry );
+
+    /**
+     * Called on a worker thread once every entry of a directory was seen.
+     */
+    virtual void leaveDir( afc_client_t client, const QString& path );
+
+    /**
+     * Called regularly on the thread running walk().
+     */
+    virtual void progress();
+
+    void fail( afc_error_t err );
+
+private:
+    friend class AfcWalkWorker;
+
+    void work( afc_client_t client );
+    bool take( QString& dir );
+    void done();
+    bool skip( afc_error_t err, const QString& path );
+
+    AfcClientPool* _pool;
+    afc_client_t _afc;
+    int _nbWorkers;
+
+    mutable QMutex _mutex;
+    QWaitCondition _changed;
+    QStack<QString> _dirs;
+    int _busy;
+    int _running;
+    quint64 _skipped;
+    afc_error_t _err;
+};
+
+/**
+ * Removes a tree: files are removed by the walk itself, directories
+ * afterwards, deepest first.
+ */
+class AfcTreeRemover : public AfcTreeWalker
+{
+public:
+    AfcTreeRemover( AfcClientPool* pool, afc_client_t afc, int nbWorkers );
+
+    afc_error_t remove( const QString& root );
+
+protected:
+    virtual bool visitFile( afc_client_t client, const QString& path, const KIO::UDSEntry& entry );
+    virtual bool visitDir( afc_client_t client, const QString& path, const KIO::UDSEntry& entry );
+
+private:
+    afc_client_t _afc;
+    QMutex _dirsMutex;
+    QStringList _dirs;
+};
+
+/**
+ * Adds up the size of the files of a tree, reporting partial totals
+ * while the walk goes on.
+ */
+class AfcSizeWalker : public AfcTreeWalker
+{
+public:
+    AfcSizeWalker( AfcClientPool* pool, afc_client_t afc, int nbWorkers, KIO::SlaveBase* slave );
+
+    KIO::filesize_t totalSize() const;
+    quint64 files() const;
+    quint64 directories() const;
+
+protected:
+    virtual bool visitFile( afc_client_t client, const QString& path, const KIO::UDSEntry& entry );
+    virtual bool visitDir( afc_client_t client, const QString& path, const KIO::UDSEntry& entry );
+    virtual void progress();
+
+private:
+    KIO::SlaveBase* _slave;
+
+    mutable QMutex _totalsMutex;
+    KIO::filesize_t _size;
+    quint64 _files;
+    quint64 _dirs;
+};
+
+#endif // AFCTREEWALKER_H
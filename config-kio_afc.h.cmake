@@ -0,0 +1,8 @@
+/* Define to 1 if you have posix_fadvise */
+#cmakedefine HAVE_POSIX_FADVISE 1
+
+/* Define to 1 if you have posix_fallocate */
+#cmakedefine HAVE_POSIX_FALLOCATE 1
+
+/* Define to 1 if libimobiledevice has afc_remove_path_and_contents */
+#cmakedefine HAVE_AFC_REMOVE_PATH_AND_CONTENTS 1
@@ -19,8 +19,13 @@
 */
 
 #include "kio_afc.h"
+#include "afcdirlister.h"
+#include "afcsearch.h"
+#include "afcfanout.h"
 #include <QtCore/QCoreApplication>
 #include <QtCore/QDir>
+#include <QtCore/QDataStream>
+#include <QtCore/QStringList>
 #include <kcomponentdata.h>
 #include <kglobal.h>
 #include <kdebug.h>
@@ -66,7 +71,7 @@ QString AfcProtocol::m_user = QString();
 QString AfcProtocol::m_group = QString();
 
 AfcProtocol::AfcProtocol( const QByteArray &pool, const QByteArray &app )
-    : SlaveBase( "afc", pool, app ), _opened_device(NULL)
+    : SlaveBase( "afc", pool, app ), _devices(this), _lastPath("", "")
 {
     //store current user and group since AFC does not handle permissions
     struct passwd *user = getpwuid( getuid() );
@@ -82,15 +87,10 @@ AfcProtocol::AfcProtocol( const QByteArray &pool, const QByteArray &app )
 
     idevice_get_device_list (&devices, &nbDevices);
 
+    //devices are only contacted when a command needs them
     for (int i = 0; i < nbDevices; i++)
     {
-        AfcDevice* dev = new AfcDevice ( devices[i], this );
-        if (dev->isValid())
-        {
-            _devices.insert( QString(devices[i]), dev);
-        }
-        else
-            delete dev;
+        _devices.plugged( QString(devices[i]) );
     }
 
     idevice_device_list_free (devices);
@@ -100,11 +100,7 @@ AfcProtocol::AfcProtocol( const QByteArray &pool, const QByteArray &app )
 
 AfcProtocol::~AfcProtocol()
 {
-    QHash<QString, AfcDevice*>::const_iterator i = _devices.constBegin();
-    while (i != _devices.constEnd()) {
-        delete i.value();
-        ++i;
-    }
+    //no more events once the devices go away
     idevice_event_unsubscribe ();
 }
 
@@ -113,47 +109,55 @@ void AfcProtocol::ProcessEvent(const idevice_event_t *event)
     if ( IDEVICE_DEVICE_ADD == event->event )
     {
         kDebug(KIO_AFC) << "IDEVICE_DEVICE_ADD";
-
-        AfcDevice* dev = new AfcDevice ( event->uuid, this );
-        if (dev->isValid())
-        {
-            _devices.insert( QString(event->uuid), dev);
-        }
-        else
-            delete dev;
+        _devices.plugged( QString(event->uuid) );
     }
     else if  ( IDEVICE_DEVICE_REMOVE == event->event )
     {
         kDebug(KIO_AFC) << "IDEVICE_DEVICE_REMOVE";
-
-        AfcDevice* dev = _devices[QString(event->uuid)];
-        delete dev;
-        _devices.remove(QString(event->uuid));
+        _devices.unplugged( QString(event->uuid) );
     }
 }
 
 AfcPath AfcProtocol::checkURL( const KUrl& url )
 {
-    kDebug(KIO_AFC) << "checkURL " << url;
-    QString surl = url.url();
-    if (surl.startsWith(QLatin1String("afc:")))
+    //stat, open and the following commands usually share their url
+    if ( url == _lastUrl )
+        return _lastPath;
+
+    AfcPath p ( "", "" );
+    if ( url.protocol() != QLatin1String("afc") )
     {
-        if (surl.length() == 4)
+        kDebug(KIO_AFC) << "checkURL not an afc url " << url;
+        return p;
+    }
+
+    //only paths with empty, . or .. parts need cleaning
+    QString path = url.path();
+    if ( path.contains(QLatin1String("//")) || path.contains(QLatin1String("/.")) )
+        path = QDir::cleanPath( path );
+    if ( path.length() > 1 && path.endsWith('/') )
+        path.chop(1);
+
+    //the first part names the device by id, whatever its length, or by name
+    const int slash = path.indexOf('/', 1);
+    const QString host = path.mid(1, slash < 0 ? -1 : slash - 1);
+    if ( !host.isEmpty() )
+    {
+        p.m_host = host;
+        p.m_path = slash < 0 ? QString("/") : path.mid(slash);
+
+        //unknown devices may show up later, only known ones are kept
+        if ( !_devices.resolve(host, p.m_host) )
         {
-            // just the above
-            kDebug(KIO_AFC) << "checkURL return1 " << surl << " " << url;
-            return AfcPath("","");
+            kDebug(KIO_AFC) << "checkURL unknown device " << p;
+            return p;
         }
-
-        QString path = QDir::cleanPath( url.path() );
-        AfcPath p ( path.mid(1,40), path.mid(41) );
-        if ( p.m_path == "" ) p.m_path = "/"; //make sure we start at root
-        kDebug(KIO_AFC) << "checkURL return2 " << surl << " " << p;
-        return p;
     }
 
-    kDebug(KIO_AFC) << "checkURL return 3 ";
-    return AfcPath("","");
+    kDebug(KIO_AFC) << "checkURL " << url << " " << p;
+    _lastUrl = url;
+    _lastPath = p;
+    return p;
 }
 
 
@@ -172,9 +176,9 @@ void AfcProtocol::get( const KUrl& url )
         return;
     }
 
-    AfcDevice* dev = _devices[path.m_host];
+    AfcDeviceHandle dev = _devices.find(path.m_host);
 
-    if ( NULL != dev )
+    if ( !dev.isNull() )
     {
         KIO::Error err;
         if ( !dev->get(path.m_path, err) )
@@ -210,9 +214,9 @@ void AfcProtocol::put( const KUrl& url, int _mode,
         return;
     }
 
-    AfcDevice* dev = _devices[path.m_host];
+    AfcDeviceHandle dev = _devices.find(path.m_host);
 
-    if ( NULL != dev )
+    if ( !dev.isNull() )
     {
         KIO::Error err;
         if ( !dev->put(path.m_path, _flags, err ) )
@@ -230,6 +234,54 @@ void AfcProtocol::put( const KUrl& url, int _mode,
     finished();
 }
 
+void AfcProtocol::copy( const KUrl &src, const KUrl &dest,
+                        int permissions, KIO::JobFlags flags )
+{
+    kDebug(KIO_AFC) << src << "to " << dest;
+
+    //only copies between the device and the local disk are done here,
+    //KIO falls back to get and put for anything else
+    const bool toFile = dest.isLocalFile() && src.protocol() == QLatin1String("afc");
+    const bool fromFile = src.isLocalFile() && dest.protocol() == QLatin1String("afc");
+
+    if ( !toFile && !fromFile )
+    {
+        error( KIO::ERR_UNSUPPORTED_ACTION, src.prettyUrl() );
+        return;
+    }
+
+    const AfcPath path = checkURL( toFile ? src : dest );
+
+    if ( path.isRoot() )
+    {
+        error(KIO::ERR_IS_DIRECTORY, "/");
+        return;
+    }
+
+    AfcDeviceHandle device = _devices.find(path.m_host);
+
+    if ( device.isNull() )
+    {
+        error(KIO::ERR_DOES_NOT_EXIST, "Could not find specified device");
+        return;
+    }
+
+    KIO::Error err;
+    bool ok;
+    if ( toFile )
+        ok = device->copyToFile( path.m_path, dest.toLocalFile(), permissions, flags, err );
+    else
+        ok = device->copyFromFile( src.toLocalFile(), path.m_path, permissions, flags, err );
+
+    if ( !ok )
+    {
+        error( err, toFile ? dest.toLocalFile() : path.m_path );
+        return;
+    }
+
+    finished();
+}
+
 void AfcProtocol::rename( const KUrl &src, const KUrl &dest,
                           KIO::JobFlags flags )
 {
@@ -243,9 +295,9 @@ void AfcProtocol::rename( const KUrl &src, const KUrl &dest,
 
     if ( path_src.m_host == path_dest.m_host )
     {
-        AfcDevice* device = _devices[path_src.m_host];
+        AfcDeviceHandle device = _devices.find(path_src.m_host);
 
-        if ( NULL == device )
+        if ( device.isNull() )
         {
             error(KIO::ERR_DOES_NOT_EXIST, "Could not find specified device");
             return;
@@ -278,9 +330,9 @@ void AfcProtocol::symlink( const QString &target, const KUrl &dest,
 
     if ( target.contains( path_dest.m_host, Qt::CaseSensitive ) )
     {
-        AfcDevice* device = _devices[path_dest.m_host];
+        AfcDeviceHandle device = _devices.find(path_dest.m_host);
 
-        if ( NULL == device )
+        if ( device.isNull() )
         {
             error(KIO::ERR_DOES_NOT_EXIST, "Could not find specified device");
             return;
@@ -331,9 +383,9 @@ void AfcProtocol::stat( const KUrl& url )
         return;
     }
 
-    AfcDevice* device = _devices[path.m_host];
+    AfcDeviceHandle device = _devices.find(path.m_host);
 
-    if ( NULL == device )
+    if ( device.isNull() )
     {
         error(KIO::ERR_DOES_NOT_EXIST, "Could not find specified device");
         return;
@@ -361,8 +413,10 @@ void AfcProtocol::listDir( const KUrl& url )
     {
         //root case if only one device plugged, then redirect
         //otherwise display all devices
+        _devices.dropGone();
 
-        QHash<QString, AfcDevice*>::const_iterator i = _devices.constBegin();
+        const QList<AfcDeviceHandle> devices = _devices.devices();
+        QList<AfcDeviceHandle>::const_iterator i = devices.constBegin();
 
 //        if (_devices.size() == 1)
 //        {
@@ -373,29 +427,34 @@ void AfcProtocol::listDir( const KUrl& url )
 //        }
 //        else
 //        {
-        while (i != _devices.constEnd())
+        AfcListBatch batch(this);
+        while (i != devices.constEnd())
         {
-            AfcDevice* dev = i.value();
+            AfcDeviceHandle dev = *i;
             UDSEntry entry;
-            dev->createRootUDSEntry(entry);
-            listEntry( entry, false );
+            if ( dev->isPresent() && dev->createRootUDSEntry(entry) )
+                batch.append( entry );
             ++i;
         }
 //        }
-        listEntry(UDSEntry(), true);
+        batch.finish();
     }
     else
     {
-        AfcDevice* device = _devices[path.m_host];
+        AfcDeviceHandle device = _devices.find(path.m_host);
 
-        if ( NULL == device )
+        if ( device.isNull() )
         {
             error(KIO::ERR_DOES_NOT_EXIST, "Could not find specified device");
             return;
         }
 
         KIO::Error err;
-        if ( !device->listDir(path.m_path, err) )
+        //afc:/<udid>/folder?search=... lists the matches below folder
+        const bool ok = url.hasQueryItem("search") ?
+                        device->listSearch( path.m_path, AfcSearchQuery(url), err ) :
+                        device->listDir( path.m_path, err );
+        if ( !ok )
         {
             error ( err, path.m_path );
             return;
@@ -411,9 +470,9 @@ void AfcProtocol::mkdir( const KUrl& url, int permissions )
     // check (correct) URL
     const AfcPath path = checkURL(url);
 
-    AfcDevice* device = _devices[path.m_host];
+    AfcDeviceHandle device = _devices.find(path.m_host);
 
-    if ( NULL == device )
+    if ( device.isNull() )
     {
         error(KIO::ERR_DOES_NOT_EXIST, "Could not find specified device");
         return;
@@ -436,9 +495,9 @@ void AfcProtocol::setModificationTime( const KUrl& url, const QDateTime& mtime )
     // check (correct) URL
     const AfcPath path = checkURL(url);
 
-    AfcDevice* device = _devices[path.m_host];
+    AfcDeviceHandle device = _devices.find(path.m_host);
 
-    if ( NULL == device )
+    if ( device.isNull() )
     {
         error(KIO::ERR_DOES_NOT_EXIST, "Could not find specified device");
         return;
@@ -461,9 +520,9 @@ void AfcProtocol::del( const KUrl& url, bool isfile)
     // check (correct) URL
     const AfcPath path = checkURL(url);
 
-    AfcDevice* device = _devices[path.m_host];
+    AfcDeviceHandle device = _devices.find(path.m_host);
 
-    if ( NULL == device )
+    if ( device.isNull() )
     {
         error(KIO::ERR_DOES_NOT_EXIST, "Could not find specified device");
         return;
@@ -486,9 +545,9 @@ void AfcProtocol::open( const KUrl &url, QIODevice::OpenMode mode )
     // check (correct) URL
     const AfcPath path = checkURL(url);
 
-    _opened_device = _devices[path.m_host];
+    _opened_device = _devices.find(path.m_host);
 
-    if ( NULL == _opened_device )
+    if ( _opened_device.isNull() )
     {
         error(KIO::ERR_DOES_NOT_EXIST, "Could not find specified device");
         return;
@@ -508,7 +567,7 @@ void AfcProtocol::open( const KUrl &url, QIODevice::OpenMode mode )
 
 void AfcProtocol::read( KIO::filesize_t size )
 {
-    Q_ASSERT(_opened_device != NULL);
+    Q_ASSERT(!_opened_device.isNull());
 
     KIO::Error err;
     if ( !_opened_device->read(size,err) )
@@ -520,7 +579,7 @@ void AfcProtocol::read( KIO::filesize_t size )
 
 void AfcProtocol::write( const QByteArray &data )
 {
-    Q_ASSERT(_opened_device != NULL);
+    Q_ASSERT(!_opened_device.isNull());
 
     KIO::Error err;
     if ( !_opened_device->write(data,err) )
@@ -532,7 +591,7 @@ void AfcProtocol::write( const QByteArray &data )
 
 void AfcProtocol::seek( KIO::filesize_t offset )
 {
-    Q_ASSERT(_opened_device != NULL);
+    Q_ASSERT(!_opened_device.isNull());
 
     KIO::Error err;
     if ( !_opened_device->seek(offset,err) )
@@ -544,11 +603,168 @@ void AfcProtocol::seek( KIO::filesize_t offset )
 
 void AfcProtocol::close()
 {
-    Q_ASSERT(_opened_device != NULL);
+    Q_ASSERT(!_opened_device.isNull());
+
+    KIO::Error err;
+    const bool flushed = _opened_device->flush(err);
     _opened_device->close();
-    _opened_device = NULL;
+    _opened_device.clear();
+
+    if ( !flushed )
+    {
+        error (err, "Error while writing");
+        return;
+    }
     finished();
 }
 
+void AfcProtocol::special( const QByteArray &data )
+{
+    QDataStream stream( data );
+    int command;
+    stream >> command;
+
+    kDebug(KIO_AFC) << "special command" << command;
+
+    switch ( command )
+    {
+    case AFC_SPECIAL_DIRECTORY_SIZE:
+    {
+        KUrl url;
+        stream >> url;
+
+        const AfcPath path = checkURL(url);
+        AfcDeviceHandle device = _devices.find(path.m_host);
+
+        if ( device.isNull() )
+        {
+            error(KIO::ERR_DOES_NOT_EXIST, "Could not find specified device");
+            return;
+        }
+
+        KIO::Error err;
+        if ( ! device->directorySize(path.m_path, err ) )
+        {
+            error(err, path.m_path);
+            return;
+        }
+        break;
+    }
+    case AFC_SPECIAL_SEARCH:
+    {
+        KUrl url;
+        stream >> url;
+
+        const AfcPath path = checkURL(url);
+        AfcDeviceHandle device = _devices.find(path.m_host);
+
+        if ( device.isNull() )
+        {
+            error(KIO::ERR_DOES_NOT_EXIST, "Could not find specified device");
+            return;
+        }
+
+        KIO::Error err;
+        if ( ! device->search(path.m_path, AfcSearchQuery(url), err ) )
+        {
+            error(err, path.m_path);
+            return;
+        }
+        break;
+    }
+    case AFC_SPECIAL_SYNC:
+    {
+        QString localPath;
+        KUrl url;
+        int flags;
+        stream >> localPath >> url >> flags;
+
+        const AfcPath path = checkURL(url);
+        AfcDeviceHandle device = _devices.find(path.m_host);
+
+        if ( device.isNull() )
+        {
+            error(KIO::ERR_DOES_NOT_EXIST, "Could not find specified device");
+            return;
+        }
+
+        KIO::Error err;
+        if ( ! device->sync(localPath, path.m_path, flags, err ) )
+        {
+            error(err, path.m_path);
+            return;
+        }
+        break;
+    }
+    case AFC_SPECIAL_FANOUT:
+    {
+        QString localPath;
+        QString path;
+        QStringList ids;
+        stream >> localPath >> path >> ids;
+
+        if ( ids.isEmpty() )
+            ids = _devices.ids();
+
+        //held until the end of the transfer
+        QList<AfcDeviceHandle> devices;
+        AfcFanOut fanOut(this);
+        foreach ( const QString& id, ids )
+        {
+            AfcDeviceHandle device = _devices.find(id);
+            if ( device.isNull() )
+            {
+                error(KIO::ERR_DOES_NOT_EXIST, id);
+                return;
+            }
+            //a device keeps the state of one opened file, it is sent the
+            //file once however often it is named
+            if ( devices.contains(device) )
+                continue;
+            devices.append(device);
+            fanOut.addTarget( id, device.data(), QDir::cleanPath( '/' + path ) );
+        }
+
+        KIO::Error err;
+        if ( ! fanOut.send(localPath, err ) )
+        {
+            error(err, path);
+            return;
+        }
+        break;
+    }
+    case AFC_SPECIAL_FREE_SPACE:
+    {
+        KUrl url;
+        stream >> url;
+
+        const AfcPath path = checkURL(url);
+        AfcDeviceHandle device = _devices.find(path.m_host);
+
+        if ( device.isNull() )
+        {
+            error(KIO::ERR_DOES_NOT_EXIST, "Could not find specified device");
+            return;
+        }
+
+        KIO::filesize_t total;
+        KIO::filesize_t available;
+        KIO::Error err;
+        if ( ! device->freeSpace(total, available, err ) )
+        {
+            error(err, path.m_path);
+            return;
+        }
+        setMetaData( "total", QString::number( total ) );
+        setMetaData( "available", QString::number( available ) );
+        break;
+    }
+    default:
+        error( KIO::ERR_UNSUPPORTED_ACTION, QString::number(command) );
+        return;
+    }
+
+    finished();
+}
 
 #include "kio_afc.moc"
@@ -12,16 +12,52 @@
 
 #include <kio/global.h>
 #include <kio/slavebase.h>
+#include <kurl.h>
 
 #include <QtCore/QObject>
 #include <QtCore/QHash>
 #include <QtCore/QString>
 
 #include "afcdevice.h"
+#include "afcdeviceregistry.h"
 #include "afcpath.h"
 
 #include <libimobiledevice/libimobiledevice.h>
 
+/**
+ * Commands understood by AfcProtocol::special(). The data starts with
+ * the command as an int, followed by its arguments.
+ */
+enum AfcSpecialCommand
+{
+  /** KUrl: walks the folder, result in the total-size, files,
+      directories and skipped (unreadable entries) metadata */
+  AFC_SPECIAL_DIRECTORY_SIZE = 1,
+  /** KUrl: folder to search, the query items describe the search (see
+      AfcSearchQuery), matching urls are sent as data, one per line */
+  AFC_SPECIAL_SEARCH = 2,
+  /** QString local folder, KUrl destination, int AfcSyncFlag: copies the
+      new and changed files, the bytes-transferred, bytes-skipped,
+      files-transferred, files-skipped and files-deleted metadata tell
+      what was done */
+  AFC_SPECIAL_SYNC = 3,
+  /** QString local file, QString path on the devices, QStringList device
+      ids (all devices if empty): sends the file to every device at once,
+      see AfcFanOut for the metadata */
+  AFC_SPECIAL_FANOUT = 4,
+  /** KUrl: size and free room of the device file system, in bytes, in
+      the total and available metadata */
+  AFC_SPECIAL_FREE_SPACE = 5
+};
+
+enum AfcSyncFlag
+{
+  /** remove what is on the device but not in the local folder */
+  AFC_SYNC_DELETE = 1,
+  /** files with the same size but another mtime are compared by content */
+  AFC_SYNC_CHECKSUM = 2
+};
+
 class AfcProtocol : public QObject, public KIO::SlaveBase
 {
   Q_OBJECT
@@ -40,6 +76,9 @@ public:
   virtual void put( const KUrl& url, int _mode,
                     KIO::JobFlags _flags );
 
+  virtual void copy( const KUrl &src, const KUrl &dest,
+                     int permissions, KIO::JobFlags flags );
+
   virtual void rename( const KUrl &src, const KUrl &dest,
                        KIO::JobFlags flags );
   virtual void symlink( const QString &target, const KUrl &dest,
@@ -55,14 +94,20 @@ public:
   virtual void seek( KIO::filesize_t offset );
   virtual void close();
 
+  virtual void special( const QByteArray &data );
+
   //cached user and group
   static QString m_user;
   static QString m_group;
 
 private:
 
-  QHash<QString, AfcDevice*> _devices;
-  AfcDevice* _opened_device;
+  AfcDeviceRegistry _devices;
+  AfcDeviceHandle _opened_device;
+
+  //last url given to checkURL() and its result
+  KUrl _lastUrl;
+  AfcPath _lastPath;
 
 };
 